@@ -1,6 +1,6 @@
+#include "hashtable.h" // First, so it can ask for the POSIX feature level it needs
 #include <stdio.h>
 #include <stdlib.h>
-#include "hashtable.h"
 
 int main() {
     // Create a new hashtable
@@ -30,189 +30,2854 @@
 #ifndef HASHTABLE_H
 #define HASHTABLE_H
 
+// Strict -std=c11 hides the POSIX calls below (clock_gettime, pread, strdup...) unless a feature level is asked for
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // syscall and madvise
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/falloc.h>
+#endif
 
 #define INITIAL_TABLE_SIZE 128
 #define LOAD_FACTOR_THRESHOLD 0.75
+#define TREEIFY_THRESHOLD 8           // chain length at which a bucket becomes a sorted tree
+#define UNTREEIFY_THRESHOLD 6         // tree size at which a bucket goes back to a plain chain
+#define REHASH_CHUNK 4096             // buckets claimed at a time by a rehashing thread
+#define RESEED_CHAIN_FACTOR 2         // reseed once a chain is longer than this many times log2 of the bucket count
+#define PROMOTE_ODDS 8                // a lookup hit moves its entry to the chain head once in this many hits
+#define SPARSE_GROUP_BITS 6           // a DB_SPARSE table keeps its buckets in bitmap groups of 1 << this many
+#define SPARSE_LOCK_BITS 9            // and one lock per 1 << this many buckets, a whole number of groups
+#define TRY_LOCK_SPINS 64             // failed trylocks before a deadline-bound operation starts yielding
+#define WAIT_STRIPES 64               // futex words per table that db_wait sleeps on, keys are spread over them by hash
+#define LOG_PAGE_BITS 20              // hybrid log pages are 1 << this many bytes, a record takes at most a page less 8 bytes
+#define LOG_PAGE_SIZE ((uint64_t)1 << LOG_PAGE_BITS)
+#define LOG_READ_ONLY_SHARE 4         // one in this many resident log pages (at least one) is read-only
+#define SNAPSHOT_SEGMENT_KEYS 1024    // keys per segment of a segmented snapshot, the unit a warm start loads on demand
+#define PREFAULT_CHUNK_BYTES ((size_t)1 << 21) // bytes claimed at a time by a prefaulting thread
+#define FROZEN_BUCKET_KEYS 3          // average keys per pilot bucket in a frozen table
+#define FROZEN_LOAD_FACTOR 0.99       // keys per pilot position, positions past the key count are remapped into free slots
+#define FROZEN_MAX_PILOT (1u << 16)   // pilot search limit before picking a new seed, pilots are stored in 16 bits
+
+// Build with HASHTABLE_COMPACT_REFS defined to keep entries in a per-table arena and
+// link them with 32-bit references instead of pointers (at most 2^32 - 1 entries per table)
+// The arena is append-only and keeps insertion order; deletes leave holes that the next rehash compacts
+#ifdef HASHTABLE_COMPACT_REFS
+#define ARENA_FIRST_SLAB_BITS 10      // the first arena slab holds 1 << this many entries
+#define ARENA_SLABS 23                // each slab holds twice as many entries as the one before
+#endif
+
+// Build with HASHTABLE_TAGGED_BUCKETS defined to keep a 16-bit summary of each chain's hashes
+// in the unused top bits of its bucket slot, so most misses are rejected from the bucket array alone
+#ifdef HASHTABLE_TAGGED_BUCKETS
+#if UINTPTR_MAX != UINT64_MAX
+#error "HASHTABLE_TAGGED_BUCKETS needs 64-bit pointers"
+#endif
+#define SLOT_TAG_SHIFT 48
+#define SLOT_REF_MASK ((UINT64_C(1) << SLOT_TAG_SHIFT) - 1)
+#endif
+
+// Table flags for db_open_flags
+#define DB_MOVE_TO_FRONT 0x1          // lookup hits move their entry toward the head of its chain
+#define DB_SPARSE 0x2                 // bitmap-indexed bucket groups and one lock per group, memory over speed
+#define DB_SET 0x4                    // keys only, entries are allocated without their value fields
+#define DB_LOG 0x8                    // records live in a hybrid log instead of entries, set by db_open_log
+#define DB_PREFAULT 0x10              // db_deserialize and db_warm_start fault the table's memory in, see db_prefault
+
+#define DB_BUSY (-2)                  // returned by the db_try_* functions when their deadline passes first
+
+#ifdef HASHTABLE_COMPACT_REFS
+typedef uint32_t EntryRef;           // 1-based index into the table's entry arena
+#define ENTRY_HITS_MAX 0xFFFF        // hits share the version word, keeping compact entries at 40 bytes
+#else
+typedef struct Entry *EntryRef;
+#define ENTRY_HITS_MAX UINT32_MAX
+#endif
+#define ENTRY_NONE ((EntryRef)0)
 
 typedef struct Entry {
     char *key;           
-    void *value;        
+    unsigned int hash;   // full hash of key
+#ifdef HASHTABLE_COMPACT_REFS
+    EntryRef next;
+    uint64_t version : 47; // table version clock at the entry's last change, see db_wait
+    uint64_t hits : 16;    // lookups that found the entry, saturating at ENTRY_HITS_MAX, orders hot snapshots
+#else
+    uint32_t hits;       // lookups that found the entry, saturating at ENTRY_HITS_MAX, orders hot snapshots; fills padding
+    EntryRef next;
+    uint64_t version : 63; // table version clock at the entry's last change, see db_wait
+#endif
+    uint64_t grown : 1;  // value was grown in place and has a power of two bytes allocated, see value_capacity
+    void *value;         // value fields come last so DB_SET tables can allocate entries without them
     size_t value_size;  
-    struct Entry *next;  
 } Entry;
 
+#if defined(HASHTABLE_TAGGED_BUCKETS)
+typedef uint64_t BucketSlot;         // head reference in the low 48 bits, chain summary in the top 16
+#elif defined(HASHTABLE_COMPACT_REFS)
+typedef uint8_t BucketSlot;          // slots are 1, 2 or 4 of these wide, see slot_width
+#else
+typedef EntryRef BucketSlot;
+#endif
+
+typedef struct SparseGroup {
+    uint64_t bitmap;     // non-empty buckets of the group
+    BucketSlot *slots;   // their slots, packed in bucket order
+} SparseGroup;
+
+typedef struct EntryLink {
+    Entry *entry;
+    EntryRef ref;
+} EntryLink;
+
+typedef struct BucketTree {
+    size_t count;
+    size_t capacity;
+    Entry *entries[];    // sorted by hash, then key; the bucket chain is linked in the same order
+} BucketTree;
+
+typedef enum TableState {
+    TABLE_OPEN,          // operations may enter
+    TABLE_EXCLUSIVE,     // one thread owns the table, operations wait
+    TABLE_REHASHING      // operations that arrive help move buckets
+} TableState;
+
 typedef struct Hashtable {
-    Entry **table;         
-    pthread_mutex_t *locks; 
+    BucketSlot *table;         
+    SparseGroup *groups;          // DB_SPARSE tables keep their slots here instead, table is NULL
+    unsigned int slot_width;      // bytes per bucket slot
+    pthread_mutex_t *locks;       // one per 1 << lock_shift buckets
+    unsigned int lock_shift;
     size_t size;          
-    size_t count;         
+    size_t initial_size;          // size the table was opened with, db_clear starts over at it
+    atomic_size_t count;         
+    unsigned int flags;           // DB_* table flags
+    size_t entry_size;            // bytes per entry, DB_SET entries stop before value
+    _Atomic(BucketTree **) trees; // per-bucket trees, allocated on first treeify
+    uint64_t seed;                // hash seed, 0 until the first reseed
+    size_t reseed_count;          // count at the last reseed
+    atomic_size_t active_ops;     // operations currently inside the table
+    atomic_int state;             // TableState
+    unsigned int rehash_threads;  // helper threads started for each rehash
+    struct Hashtable *namespaces; // namespace tables by name, NULL until the first db_ns_open
+    struct HybridLog *log;        // DB_LOG tables keep their records here, table and groups are NULL
+    struct WriteBehind *write_behind; // per-thread db_insert buffers, NULL unless db_write_behind was called
+    struct WarmStart *warm;       // snapshot still being loaded, NULL unless db_warm_start was called
+    pthread_mutex_t ns_lock;      // guards opening and dropping namespaces
+    atomic_uint_fast64_t version_clock; // last entry version handed out
+    atomic_uint waiting;          // threads inside db_wait, writers skip the wait stripes while it is 0
+    atomic_uint wait_seq[WAIT_STRIPES]; // bumped after a change to a key of the stripe while someone waits
+#ifdef HASHTABLE_COMPACT_REFS
+    _Atomic(char *) slabs[ARENA_SLABS]; // entry arena of entry_size strides, allocated as it fills
+    atomic_uint arena_next;       // arena entries handed out so far, holes included
+#endif
+
+    // Rehash in progress, shared with the threads helping it
+    BucketSlot *new_table;
+    SparseGroup *new_groups;
+    unsigned int new_slot_width;
+    pthread_mutex_t *new_locks;
+    size_t new_size;
+    uint64_t new_seed;
+    size_t rehash_items;          // buckets, or arena entries in compact builds
+    size_t rehash_chunks;
+    atomic_size_t rehash_next;    // next chunk to claim
+    atomic_size_t rehash_done;    // chunks finished
+    atomic_size_t rehash_helpers; // threads inside help_rehash
 } Hashtable;
 
-// Hash function
-unsigned int hash(const char *key, size_t table_size) {
+typedef struct WriteBuffer {
+    Hashtable *ht;               // table the writes are for
+    Hashtable *pending;          // newest buffered value of each key
+    struct timespec flush_at;    // when the oldest buffered write is due
+    pthread_mutex_t lock;        // taken by the owning thread and the flusher thread
+    struct WriteBuffer *next;
+} WriteBuffer;
+
+typedef struct WriteBehind {
+    pthread_key_t key;           // the calling thread's WriteBuffer
+    size_t max_pending;          // buffered keys that trigger a flush
+    long interval_ms;            // longest a write stays buffered, 0 without a flusher thread
+    pthread_mutex_t lock;        // guards buffers and stop
+    pthread_cond_t wake;         // wakes the flusher thread early to stop it
+    WriteBuffer *buffers;
+    pthread_t flusher;
+    int stop;
+} WriteBehind;
+
+typedef struct PendingWrite {
+    unsigned int index;
+    unsigned int key_hash;
+    Entry *entry;
+} PendingWrite;
+
+void stop_write_behind(Hashtable *ht); // flushes through functions defined after free_hashtable
+
+typedef enum SegmentState {
+    SEGMENT_COLD,        // still only in the snapshot file
+    SEGMENT_LOADING,     // being inserted, other threads wait for it
+    SEGMENT_LOADED
+} SegmentState;
+
+typedef struct WarmStart {
+    int fd;                      // segmented snapshot, segments are read from it as they load
+    size_t segments;
+    uint64_t *spans;             // offset and size of each segment
+    size_t *order;               // segments in file order, hottest first, the order the loader thread takes
+    atomic_uint *states;         // SegmentState of each segment, waited on like a futex word
+    atomic_size_t loaded;        // segments loaded so far
+    atomic_size_t wanted;        // segment + 1 a deadline-bound caller waits for, the loader thread takes it next
+    atomic_int stop;             // tells the loader thread to quit early
+    pthread_t loader;
+    int has_loader;
+} WarmStart;
+
+void warm_key(Hashtable *ht, const char *key); // loads through write_key, which enters buckets itself
+int warm_key_until(Hashtable *ht, const char *key, const struct timespec *deadline);
+int delete_key(Hashtable *ht, const char *key, const struct timespec *deadline); // also drops buffered writes
+
+typedef struct LeftRightHashtable {
+    Hashtable *instances[2];
+    atomic_int left_right;       // instance readers are sent to
+    atomic_int version_index;    // read indicator new readers arrive on
+    atomic_size_t readers[2];    // read indicators
+    pthread_mutex_t writer_lock;
+} LeftRightHashtable;
+
+typedef struct RcuHashtable {
+    _Atomic(Hashtable *) current; // published table, read-only once published
+    atomic_int version_index;     // read indicator new readers arrive on
+    atomic_size_t readers[2];     // read indicators
+    pthread_mutex_t writer_lock;
+} RcuHashtable;
+
+typedef struct WriteOp {
+    const char *key;
+    void *value;
+    size_t value_size;
+    int remove;          // delete the key instead of inserting it
+} WriteOp;
+
+#define LOG_TOMBSTONE 0x1
+
+typedef struct LogRecord {
+    uint64_t prev;           // previous record of the same index bucket, an address below begin ends the chain
+    uint64_t version;        // table version clock at the record's last change, see db_wait
+    unsigned int hash;       // full hash of key
+    uint32_t flags;          // LOG_TOMBSTONE
+    uint32_t key_length;     // including the terminator
+    uint32_t value_size;
+    uint32_t value_capacity; // value bytes reserved, updates in the mutable region grow into them
+} LogRecord;                 // followed by the key and the value, each padded to 8 bytes
+
+typedef struct HybridLog {
+    int fd;                         // file holding evicted pages at their log address
+    char *frames;                   // resident pages, page p lives in frame p % frame_count
+    size_t frame_count;
+    size_t mutable_pages;           // newest pages, updated in place
+    uint64_t *index;                // bucket -> newest record address, guarded by the bucket locks
+    atomic_uint_fast64_t begin;     // records below were compacted away, see db_log_compact
+    atomic_uint_fast64_t tail;      // next free address
+    atomic_uint_fast64_t read_only; // records below are copied on update
+    atomic_uint_fast64_t head;      // records below are only in the file
+    uint64_t flushed;               // addresses below are written to the file, guarded by tail_lock
+    pthread_mutex_t tail_lock;      // serializes page turns, clears and truncations
+    pthread_mutex_t compact_lock;   // serializes db_log_compact
+    atomic_int version_index;       // epoch new operations arrive on
+    atomic_size_t readers[2];       // operations inside each epoch
+} HybridLog;
+
+typedef struct FrozenHashtable {
+    size_t count;        // number of keys, also the number of slots
+    size_t positions;    // positions pilots send keys to, a few more than slots
+    size_t buckets;      // number of pilot buckets
+    uint64_t seed;
+    uint16_t *pilots;    // per-bucket displacement
+    uint64_t *remap;     // position - count -> slot, for the positions past the last slot
+    uint64_t *offsets;   // slot -> record offset in data
+    char *data;          // packed records, see db_freeze
+} FrozenHashtable;
+
+// 64-bit finalizer (splitmix64)
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Seeded 64-bit hash function
+uint64_t hash64(const char *key, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+    int c;
+    while ((c = *key++)) {
+        hash = (hash ^ (unsigned char)c) * 0x100000001b3ULL; // FNV-1a
+    }
+    return mix64(hash);
+}
+
+// Full hash of a key under a table seed
+unsigned int hash_key(const char *key, uint64_t seed) {
+    if (seed) {
+        return (unsigned int)hash64(key, seed);
+    }
+
     unsigned int hash = 5381;
     int c;
     while ((c = *key++)) {
         hash = ((hash << 5) + hash) + c; // hash * 33 + c
     }
-    return hash % table_size;
+    return hash;
 }
 
-// Create a hashtable
-Hashtable *create_hashtable(size_t initial_size) {
+// Hash function
+unsigned int hash(const char *key, size_t table_size) {
+    return hash_key(key, 0) % table_size;
+}
+
+// Wait until a read indicator has no readers
+void wait_for_readers(atomic_size_t *readers) {
+    while (atomic_load(readers) != 0) {
+        sched_yield();
+    }
+}
+
+// Wait until every reader that arrived before this call has departed
+// New readers are sent to the other indicator so writers are not starved
+void synchronize_readers(atomic_int *version_index, atomic_size_t readers[2]) {
+    int version = atomic_load(version_index);
+    wait_for_readers(&readers[1 - version]);
+    atomic_store(version_index, 1 - version);
+    wait_for_readers(&readers[version]);
+}
+
+// Absolute CLOCK_MONOTONIC deadline timeout_ms milliseconds from now
+struct timespec deadline_after(long timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+// Time left until a deadline, returns 0 once it has passed
+int time_left(const struct timespec *deadline, struct timespec *left) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0) {
+        left->tv_sec--;
+        left->tv_nsec += 1000000000;
+    }
+    return left->tv_sec > 0 || (left->tv_sec == 0 && left->tv_nsec > 0);
+}
+
+// Sleep while a word still holds observed, for at most timeout (NULL waits for a wake)
+// Returns early on wakeups, signals and spurious wakeups, callers recheck their condition
+void wait_on_word(atomic_uint *word, unsigned int observed, const struct timespec *timeout) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, observed, timeout, NULL, 0);
+#else
+    struct timespec nap = {0, 1000000}; // Poll every millisecond where there is no futex
+    if (timeout && (timeout->tv_sec == 0 && timeout->tv_nsec < nap.tv_nsec)) nap = *timeout;
+    if (atomic_load(word) == observed) nanosleep(&nap, NULL);
+#endif
+}
+
+// Wake every thread sleeping on a word
+void wake_word(atomic_uint *word) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)word; // Sleepers poll the word
+#endif
+}
+
+// Bytes per bucket slot able to hold entry references up to refs
+// Compact builds without tags store references in 1, 2 or 4 bytes, so small tables keep a tiny bucket array
+unsigned int slot_width(size_t refs) {
+#if defined(HASHTABLE_COMPACT_REFS) && !defined(HASHTABLE_TAGGED_BUCKETS)
+    return refs <= UINT8_MAX ? 1 : refs <= UINT16_MAX ? 2 : 4;
+#else
+    (void)refs;
+    return sizeof(BucketSlot);
+#endif
+}
+
+// Largest entry reference a bucket slot of a width holds
+size_t slot_ref_limit(unsigned int width) {
+#if defined(HASHTABLE_COMPACT_REFS) && !defined(HASHTABLE_TAGGED_BUCKETS)
+    return width == 1 ? UINT8_MAX : width == 2 ? UINT16_MAX : UINT32_MAX;
+#elif defined(HASHTABLE_COMPACT_REFS)
+    (void)width;
+    return UINT32_MAX;
+#else
+    (void)width;
+    return SIZE_MAX;
+#endif
+}
+
+// Number of stripes of 1 << shift buckets covering a bucket count
+size_t stripe_count(size_t size, unsigned int shift) {
+    return ((size - 1) >> shift) + 1;
+}
+
+// Create a hashtable with DB_* flags
+Hashtable *create_hashtable_flags(size_t initial_size, unsigned int flags) {
     Hashtable *ht = malloc(sizeof(Hashtable));
-    ht->table = calloc(initial_size, sizeof(Entry *));
-    ht->locks = malloc(sizeof(pthread_mutex_t) * initial_size);
+    ht->slot_width = slot_width(initial_size);
+    if (flags & DB_SPARSE) {
+        ht->table = NULL;
+        ht->groups = calloc(stripe_count(initial_size, SPARSE_GROUP_BITS), sizeof(SparseGroup));
+        ht->lock_shift = SPARSE_LOCK_BITS; // A lock covers whole groups, so it also guards their repacking
+    } else if (flags & DB_LOG) {
+        ht->table = NULL; // The log's index replaces the bucket array
+        ht->groups = NULL;
+        ht->lock_shift = SPARSE_GROUP_BITS;
+    } else {
+        ht->table = calloc(initial_size, ht->slot_width);
+        ht->groups = NULL;
+        ht->lock_shift = 0;
+    }
+    ht->locks = malloc(sizeof(pthread_mutex_t) * stripe_count(initial_size, ht->lock_shift));
     ht->size = initial_size;
-    ht->count = 0;
+    ht->initial_size = initial_size;
+    atomic_init(&ht->count, 0);
+    ht->flags = flags;
+    ht->entry_size = flags & DB_SET ? offsetof(Entry, value) : sizeof(Entry);
+    atomic_init(&ht->trees, NULL);
+    ht->seed = 0;
+    ht->reseed_count = 0;
+    atomic_init(&ht->active_ops, 0);
+    atomic_init(&ht->state, TABLE_OPEN);
+    ht->rehash_threads = 0;
+    ht->namespaces = NULL;
+    ht->log = NULL;
+    ht->write_behind = NULL;
+    ht->warm = NULL;
+    pthread_mutex_init(&ht->ns_lock, NULL);
+    atomic_init(&ht->version_clock, 0);
+    atomic_init(&ht->waiting, 0);
+    for (size_t i = 0; i < WAIT_STRIPES; i++) {
+        atomic_init(&ht->wait_seq[i], 0);
+    }
+    ht->new_table = NULL;
+    ht->new_groups = NULL;
+    ht->new_slot_width = 0;
+    ht->new_locks = NULL;
+    ht->new_size = 0;
+    ht->new_seed = 0;
+    ht->rehash_items = 0;
+    ht->rehash_chunks = 0;
+    atomic_init(&ht->rehash_next, 0);
+    atomic_init(&ht->rehash_done, 0);
+    atomic_init(&ht->rehash_helpers, 0);
+#ifdef HASHTABLE_COMPACT_REFS
+    for (size_t i = 0; i < ARENA_SLABS; i++) {
+        atomic_init(&ht->slabs[i], NULL);
+    }
+    atomic_init(&ht->arena_next, 0);
+#endif
 
-    for (size_t i = 0; i < initial_size; i++) {
+    for (size_t i = 0; i < stripe_count(initial_size, ht->lock_shift); i++) {
         pthread_mutex_init(&ht->locks[i], NULL);
     }
 
     return ht;
 }
 
+// Create a hashtable
+Hashtable *create_hashtable(size_t initial_size) {
+    return create_hashtable_flags(initial_size, 0);
+}
+
+#ifdef HASHTABLE_COMPACT_REFS
+// Arena slot of a 0-based entry index
+Entry *arena_slot(Hashtable *ht, uint32_t index) {
+    unsigned int slab = 31 - __builtin_clz((index >> ARENA_FIRST_SLAB_BITS) + 1);
+    uint32_t offset = index - (((1u << slab) - 1) << ARENA_FIRST_SLAB_BITS);
+    return (Entry *)(atomic_load_explicit(&ht->slabs[slab], memory_order_acquire) + offset * ht->entry_size);
+}
+
+// Entry a reference points to
+Entry *entry_at(Hashtable *ht, EntryRef ref) {
+    return ref ? arena_slot(ht, ref - 1) : NULL;
+}
+
+// Append an entry to the arena, ENTRY_NONE once the bucket slots cannot reference more entries
+EntryRef alloc_entry(Hashtable *ht, Entry **entry) {
+    uint32_t index = atomic_load(&ht->arena_next);
+    do {
+        if (index >= slot_ref_limit(ht->slot_width)) return ENTRY_NONE; // The next rehash makes room
+    } while (!atomic_compare_exchange_weak(&ht->arena_next, &index, index + 1));
+
+    unsigned int slab = 31 - __builtin_clz((index >> ARENA_FIRST_SLAB_BITS) + 1);
+    if (!atomic_load(&ht->slabs[slab])) {
+        char *expected = NULL;
+        char *fresh = calloc((size_t)1 << (ARENA_FIRST_SLAB_BITS + slab), ht->entry_size);
+        if (!atomic_compare_exchange_strong(&ht->slabs[slab], &expected, fresh)) {
+            free(fresh); // Another thread allocated the slab first
+        }
+    }
+    *entry = arena_slot(ht, index);
+    return index + 1;
+}
+
+// Leave a hole in the arena where an entry was, the next rehash compacts it away
+void free_entry(Hashtable *ht, EntryRef ref, Entry *entry) {
+    (void)ref;
+    entry->key = NULL;
+    if (!(ht->flags & DB_SET)) entry->value = NULL;
+}
+
+// Slide live entries down over the holes, keeping their order, the caller holds the table exclusively
+// Returns the number of live entries, which is also the new arena length
+size_t compact_arena(Hashtable *ht) {
+    size_t used = atomic_load(&ht->arena_next), live = 0;
+    for (size_t i = 0; i < used; i++) {
+        Entry *entry = arena_slot(ht, i);
+        if (!entry->key) continue;
+        if (live != i) memcpy(arena_slot(ht, live), entry, ht->entry_size);
+        live++;
+    }
+    atomic_store(&ht->arena_next, live);
+    return live;
+}
+
+// Free the arena slabs
+void free_arena(Hashtable *ht) {
+    for (size_t i = 0; i < ARENA_SLABS; i++) {
+        free(atomic_load(&ht->slabs[i]));
+    }
+}
+#else
+// Entry a reference points to
+Entry *entry_at(Hashtable *ht, EntryRef ref) {
+    (void)ht;
+    return ref;
+}
+
+// Allocate an entry
+EntryRef alloc_entry(Hashtable *ht, Entry **entry) {
+    *entry = malloc(ht->entry_size);
+    return *entry;
+}
+
+// Free an entry
+void free_entry(Hashtable *ht, EntryRef ref, Entry *entry) {
+    (void)ht;
+    (void)ref;
+    free(entry);
+}
+#endif
+
+#if defined(HASHTABLE_TAGGED_BUCKETS)
+// Head of the chain in a bucket slot
+EntryRef slot_head(const BucketSlot *table, unsigned int width, size_t index) {
+    (void)width;
+    return (EntryRef)(uintptr_t)(__atomic_load_n(&table[index], __ATOMIC_RELAXED) & SLOT_REF_MASK);
+}
+
+// Summary bit a hash sets in its bucket slot
+uint64_t slot_tag(unsigned int key_hash) {
+    return UINT64_C(1) << (SLOT_TAG_SHIFT + ((key_hash * 0x9e3779b1u) >> 28));
+}
+
+// Point a bucket slot at a new head, keeping its summary
+void set_slot_head(BucketSlot *table, unsigned int width, size_t index, EntryRef ref) {
+    (void)width;
+    uint64_t tags = table[index] & ~SLOT_REF_MASK;
+    __atomic_store_n(&table[index], tags | (uint64_t)(uintptr_t)ref, __ATOMIC_RELAXED);
+}
+
+// Add a hash to a bucket slot summary
+void tag_slot(BucketSlot *table, size_t index, unsigned int key_hash) {
+    __atomic_store_n(&table[index], table[index] | slot_tag(key_hash), __ATOMIC_RELAXED);
+}
+
+// Whether a bucket may hold a hash, safe to call without the bucket lock
+int slot_may_contain(const BucketSlot *table, size_t index, unsigned int key_hash) {
+    return (__atomic_load_n(&table[index], __ATOMIC_RELAXED) & slot_tag(key_hash)) != 0;
+}
+
+// Push an entry onto a bucket of a table being built, safe against concurrent pushes
+void push_slot(BucketSlot *table, unsigned int width, size_t index, EntryRef ref, Entry *entry) {
+    (void)width;
+    uint64_t old = __atomic_load_n(&table[index], __ATOMIC_RELAXED), fresh;
+    do {
+        entry->next = (EntryRef)(uintptr_t)(old & SLOT_REF_MASK);
+        fresh = (old & ~SLOT_REF_MASK) | slot_tag(entry->hash) | (uint64_t)(uintptr_t)ref;
+    } while (!__atomic_compare_exchange_n(&table[index], &old, fresh, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+#elif defined(HASHTABLE_COMPACT_REFS)
+// Head of the chain in a bucket slot
+EntryRef slot_head(const BucketSlot *table, unsigned int width, size_t index) {
+    switch (width) {
+    case 1: return table[index];
+    case 2: return ((const uint16_t *)table)[index];
+    default: return ((const uint32_t *)table)[index];
+    }
+}
+
+// Point a bucket slot at a new head
+void set_slot_head(BucketSlot *table, unsigned int width, size_t index, EntryRef ref) {
+    switch (width) {
+    case 1: table[index] = (uint8_t)ref; break;
+    case 2: ((uint16_t *)table)[index] = (uint16_t)ref; break;
+    default: ((uint32_t *)table)[index] = ref; break;
+    }
+}
+
+// Add a hash to a bucket slot summary, untagged slots have none
+void tag_slot(BucketSlot *table, size_t index, unsigned int key_hash) {
+    (void)table;
+    (void)index;
+    (void)key_hash;
+}
+
+// Whether a bucket may hold a hash, untagged slots cannot tell
+int slot_may_contain(const BucketSlot *table, size_t index, unsigned int key_hash) {
+    (void)table;
+    (void)index;
+    (void)key_hash;
+    return 1;
+}
+
+// Push an entry onto a bucket of a table being built, safe against concurrent pushes
+void push_slot(BucketSlot *table, unsigned int width, size_t index, EntryRef ref, Entry *entry) {
+    if (width == 1) {
+        uint8_t *slot = &table[index], old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        do {
+            entry->next = old;
+        } while (!__atomic_compare_exchange_n(slot, &old, (uint8_t)ref, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    } else if (width == 2) {
+        uint16_t *slot = &((uint16_t *)table)[index], old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        do {
+            entry->next = old;
+        } while (!__atomic_compare_exchange_n(slot, &old, (uint16_t)ref, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    } else {
+        uint32_t *slot = &((uint32_t *)table)[index], old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        do {
+            entry->next = old;
+        } while (!__atomic_compare_exchange_n(slot, &old, ref, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+}
+#else
+// Head of the chain in a bucket slot
+EntryRef slot_head(const BucketSlot *table, unsigned int width, size_t index) {
+    (void)width;
+    return table[index];
+}
+
+// Point a bucket slot at a new head
+void set_slot_head(BucketSlot *table, unsigned int width, size_t index, EntryRef ref) {
+    (void)width;
+    table[index] = ref;
+}
+
+// Add a hash to a bucket slot summary, untagged slots have none
+void tag_slot(BucketSlot *table, size_t index, unsigned int key_hash) {
+    (void)table;
+    (void)index;
+    (void)key_hash;
+}
+
+// Whether a bucket may hold a hash, untagged slots cannot tell
+int slot_may_contain(const BucketSlot *table, size_t index, unsigned int key_hash) {
+    (void)table;
+    (void)index;
+    (void)key_hash;
+    return 1;
+}
+#endif
+
+// Slot of a bucket in a dense table or a sparse group
+// An empty sparse bucket has none unless create is set, which inserts a zeroed slot
+BucketSlot *bucket_slot(BucketSlot *table, SparseGroup *groups, unsigned int width, size_t index, int create) {
+    if (!groups) {
+        return (BucketSlot *)((char *)table + index * width);
+    }
+
+    SparseGroup *group = &groups[index >> SPARSE_GROUP_BITS];
+    uint64_t bit = UINT64_C(1) << (index & ((1u << SPARSE_GROUP_BITS) - 1));
+    size_t rank = __builtin_popcountll(group->bitmap & (bit - 1));
+    if (!(group->bitmap & bit)) {
+        if (!create) return NULL;
+        size_t used = __builtin_popcountll(group->bitmap);
+        group->slots = realloc(group->slots, (used + 1) * width);
+        char *packed = (char *)group->slots;
+        memmove(packed + (rank + 1) * width, packed + rank * width, (used - rank) * width);
+        memset(packed + rank * width, 0, width);
+        __atomic_store_n(&group->bitmap, group->bitmap | bit, __ATOMIC_RELAXED);
+    }
+    return (BucketSlot *)((char *)group->slots + rank * width);
+}
+
+// Drop the slot of an emptied sparse bucket
+void release_slot(SparseGroup *groups, unsigned int width, size_t index) {
+    SparseGroup *group = &groups[index >> SPARSE_GROUP_BITS];
+    uint64_t bit = UINT64_C(1) << (index & ((1u << SPARSE_GROUP_BITS) - 1));
+    if (!(group->bitmap & bit)) return;
+
+    size_t rank = __builtin_popcountll(group->bitmap & (bit - 1));
+    size_t used = __builtin_popcountll(group->bitmap);
+    char *packed = (char *)group->slots;
+    memmove(packed + rank * width, packed + (rank + 1) * width, (used - rank - 1) * width);
+    __atomic_store_n(&group->bitmap, group->bitmap & ~bit, __ATOMIC_RELAXED);
+    if (!group->bitmap) {
+        free(group->slots);
+        group->slots = NULL;
+    }
+}
+
+// Free the packed slots of every sparse group
+void free_groups(SparseGroup *groups, size_t size) {
+    if (!groups) return;
+    for (size_t i = 0; i < stripe_count(size, SPARSE_GROUP_BITS); i++) {
+        free(groups[i].slots);
+    }
+    free(groups);
+}
+
+// Head of the chain in a bucket
+EntryRef bucket_head(Hashtable *ht, size_t index) {
+    BucketSlot *slot = bucket_slot(ht->table, ht->groups, ht->slot_width, index, 0);
+    return slot ? slot_head(slot, ht->slot_width, 0) : ENTRY_NONE;
+}
+
+// Point a bucket at a new head, the caller holds the bucket lock
+void set_bucket_head(Hashtable *ht, size_t index, EntryRef ref) {
+    BucketSlot *slot = bucket_slot(ht->table, ht->groups, ht->slot_width, index, ref != ENTRY_NONE);
+    if (!slot) return;
+    set_slot_head(slot, ht->slot_width, 0, ref);
+    if (ht->groups && ref == ENTRY_NONE) {
+        release_slot(ht->groups, ht->slot_width, index); // Empty buckets cost only their bitmap bit
+    }
+}
+
+// Add a hash to the summary of a bucket, the caller holds the bucket lock
+void tag_bucket(Hashtable *ht, size_t index, unsigned int key_hash) {
+    BucketSlot *slot = bucket_slot(ht->table, ht->groups, ht->slot_width, index, 0);
+    if (slot) tag_slot(slot, 0, key_hash);
+}
+
+// Whether a bucket may hold a hash, safe to call without the bucket lock
+int bucket_may_contain(Hashtable *ht, size_t index, unsigned int key_hash) {
+    if (ht->groups) {
+        // Packed slots move as the group changes, only the bitmap is safe to read here
+        uint64_t bitmap = __atomic_load_n(&ht->groups[index >> SPARSE_GROUP_BITS].bitmap, __ATOMIC_RELAXED);
+        return (bitmap >> (index & ((1u << SPARSE_GROUP_BITS) - 1))) & 1;
+    }
+    return slot_may_contain(ht->table, index, key_hash);
+}
+
+// Lock covering a bucket
+pthread_mutex_t *bucket_lock(Hashtable *ht, size_t index) {
+    return &ht->locks[index >> ht->lock_shift];
+}
+
+// Tree of a bucket, NULL while the bucket is a plain chain
+BucketTree *bucket_tree(Hashtable *ht, unsigned int index) {
+    BucketTree **trees = atomic_load(&ht->trees);
+    return trees ? trees[index] : NULL;
+}
+
+// Compare a key against an entry by hash, then key
+int entry_compare(unsigned int key_hash, const char *key, const Entry *entry) {
+    if (key_hash != entry->hash) {
+        return key_hash < entry->hash ? -1 : 1;
+    }
+    return strcmp(key, entry->key);
+}
+
+// qsort comparator for entry links
+int link_sort_compare(const void *a, const void *b) {
+    const Entry *left = ((const EntryLink *)a)->entry;
+    return entry_compare(left->hash, left->key, ((const EntryLink *)b)->entry);
+}
+
+// Position of a key in a bucket tree, or the position it would be inserted at
+size_t tree_search(const BucketTree *tree, unsigned int key_hash, const char *key, int *found) {
+    size_t low = 0, high = tree->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = entry_compare(key_hash, key, tree->entries[mid]);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    *found = 0;
+    return low;
+}
+
+// Turn a long chain into a sorted tree, the caller holds the bucket lock
+void treeify(Hashtable *ht, unsigned int index, size_t length) {
+    BucketTree **trees = atomic_load(&ht->trees);
+    if (!trees) {
+        BucketTree **fresh = calloc(ht->size, sizeof(BucketTree *));
+        if (atomic_compare_exchange_strong(&ht->trees, &trees, fresh)) {
+            trees = fresh;
+        } else {
+            free(fresh); // Another bucket allocated them first
+        }
+    }
+
+    EntryLink *links = malloc(sizeof(EntryLink) * length);
+    size_t count = 0;
+    EntryRef ref = bucket_head(ht, index);
+    while (ref) {
+        links[count].ref = ref;
+        links[count].entry = entry_at(ht, ref);
+        ref = links[count++].entry->next;
+    }
+    qsort(links, count, sizeof(EntryLink), link_sort_compare);
+
+    // Relink the chain in tree order
+    BucketTree *tree = malloc(sizeof(BucketTree) + sizeof(Entry *) * count * 2);
+    tree->count = count;
+    tree->capacity = count * 2;
+    for (size_t i = 0; i < count; i++) {
+        tree->entries[i] = links[i].entry;
+        links[i].entry->next = i + 1 < count ? links[i + 1].ref : ENTRY_NONE;
+    }
+    set_bucket_head(ht, index, links[0].ref);
+    trees[index] = tree;
+    free(links);
+}
+
+// Free every bucket tree, the chains stay linked
+void free_trees(Hashtable *ht) {
+    BucketTree **trees = atomic_exchange(&ht->trees, NULL);
+    if (!trees) return;
+
+    for (size_t i = 0; i < ht->size; i++) {
+        free(trees[i]);
+    }
+    free(trees);
+}
+
+// Position of a walk over every entry of a table
+typedef struct EntryCursor {
+    size_t index;        // arena index in compact builds, bucket index otherwise
+    Entry *entry;
+} EntryCursor;
+
+// Number of positions a walk covers, arena entries in compact builds and buckets otherwise
+size_t walk_length(Hashtable *ht) {
+#ifdef HASHTABLE_COMPACT_REFS
+    return atomic_load(&ht->arena_next);
+#else
+    return ht->size;
+#endif
+}
+
+// Next entry of a walk over positions [cursor->index, end), NULL at the end
+// The caller holds the table exclusively; compact builds walk the arena in insertion order
+Entry *next_entry_in(Hashtable *ht, EntryCursor *cursor, size_t end) {
+#ifdef HASHTABLE_COMPACT_REFS
+    while (cursor->index < end) {
+        cursor->entry = arena_slot(ht, cursor->index++);
+        if (cursor->entry->key) return cursor->entry;
+    }
+    return NULL;
+#else
+    if (cursor->entry) {
+        cursor->entry = entry_at(ht, cursor->entry->next);
+    }
+    while (!cursor->entry && cursor->index < end) {
+        cursor->entry = entry_at(ht, bucket_head(ht, cursor->index++));
+    }
+    return cursor->entry;
+#endif
+}
+
+// Next entry of a walk over the whole table started from a zeroed cursor
+Entry *next_entry(Hashtable *ht, EntryCursor *cursor) {
+    return next_entry_in(ht, cursor, walk_length(ht));
+}
+
+// Value size of an entry, DB_SET tables store none
+size_t entry_value_size(const Hashtable *ht, const Entry *entry) {
+    return ht->flags & DB_SET ? 0 : entry->value_size;
+}
+
+// Copy the value of an entry out for the caller, members of a DB_SET table read as empty values
+void *copy_value(const Hashtable *ht, const Entry *entry, size_t *value_size) {
+    *value_size = entry_value_size(ht, entry);
+    void *value = malloc(*value_size ? *value_size : 1);
+    if (*value_size) memcpy(value, entry->value, *value_size);
+    return value;
+}
+
+// Free the key and value of an entry
+void free_entry_data(Hashtable *ht, Entry *entry) {
+    free(entry->key);
+    if (!(ht->flags & DB_SET)) free(entry->value);
+}
+
+// Free a hybrid log, no operation may still be using it; the log file is left in place
+void free_log(HybridLog *log) {
+    close(log->fd);
+    pthread_mutex_destroy(&log->tail_lock);
+    pthread_mutex_destroy(&log->compact_lock);
+    free(log->frames);
+    free(log->index);
+    free(log);
+}
+
+// Stop a warm start's loader thread and free it, the snapshot's unloaded segments are dropped
+void free_warm_start(WarmStart *warm) {
+    atomic_store(&warm->stop, 1);
+    if (warm->has_loader) {
+        pthread_join(warm->loader, NULL);
+    }
+    close(warm->fd);
+    free(warm->spans);
+    free(warm->order);
+    free(warm->states);
+    free(warm);
+}
+
 // Free hashtable
 void free_hashtable(Hashtable *ht) {
-    for (size_t i = 0; i < ht->size; i++) {
-        pthread_mutex_lock(&ht->locks[i]);
-        Entry *entry = ht->table[i];
+    if (ht->warm) {
+        free_warm_start(ht->warm);
+    }
+    if (ht->write_behind) {
+        stop_write_behind(ht); // Buffered writes land before the table goes
+    }
+    if (ht->namespaces) {
+        EntryCursor cursor = {0, NULL};
+        Entry *entry;
+        while ((entry = next_entry(ht->namespaces, &cursor))) {
+            Hashtable *child;
+            memcpy(&child, entry->value, sizeof(child));
+            free_hashtable(child);
+        }
+        free_hashtable(ht->namespaces);
+    }
+    pthread_mutex_destroy(&ht->ns_lock);
+
+    if (ht->log) {
+        free_log(ht->log);
+    }
+#ifdef HASHTABLE_COMPACT_REFS
+    for (size_t i = 0; i < atomic_load(&ht->arena_next); i++) {
+        free_entry_data(ht, arena_slot(ht, i)); // NULL in holes
+    }
+    free_arena(ht);
+#else
+    for (size_t i = 0; ht->table || ht->groups ? i < ht->size : 0; i++) {
+        Entry *entry = entry_at(ht, bucket_head(ht, i));
         while (entry) {
             Entry *temp = entry;
-            entry = entry->next;
-            free(temp->key);
-            free(temp->value);
+            entry = entry_at(ht, entry->next);
+            free_entry_data(ht, temp);
             free(temp);
         }
-        pthread_mutex_unlock(&ht->locks[i]);
+    }
+#endif
+    for (size_t i = 0; i < stripe_count(ht->size, ht->lock_shift); i++) {
         pthread_mutex_destroy(&ht->locks[i]);
     }
-    free(ht->locks);
-    free(ht->table);
-    free(ht);
+    free_trees(ht);
+    free(ht->locks);
+    free(ht->table);
+    free_groups(ht->groups, ht->size);
+    free(ht);
+}
+
+// Find a key in a bucket, the caller holds the bucket lock or otherwise excludes writers
+Entry *find_entry(Hashtable *ht, unsigned int index, unsigned int key_hash, const char *key) {
+    BucketTree *tree = bucket_tree(ht, index);
+    if (tree) {
+        int found;
+        size_t position = tree_search(tree, key_hash, key, &found);
+        return found ? tree->entries[position] : NULL;
+    }
+
+    if (!bucket_may_contain(ht, index, key_hash)) {
+        return NULL; // Rejected by the bucket summary
+    }
+
+    Entry *entry = entry_at(ht, bucket_head(ht, index));
+    while (entry != NULL) {
+        if (entry->hash == key_hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+        entry = entry_at(ht, entry->next);
+    }
+    return NULL;
+}
+
+// Link an entry into a chain after its predecessor (NULL for the head), the caller holds the bucket lock
+void link_entry(Hashtable *ht, unsigned int index, Entry *prev, EntryRef ref, Entry *entry) {
+    if (prev) {
+        entry->next = prev->next;
+        prev->next = ref;
+    } else {
+        entry->next = bucket_head(ht, index);
+        set_bucket_head(ht, index, ref);
+    }
+    tag_bucket(ht, index, entry->hash);
+}
+
+// Unlink an entry from a chain given its predecessor (NULL for the head), returns its reference
+EntryRef unlink_entry(Hashtable *ht, unsigned int index, Entry *prev, Entry *entry) {
+    EntryRef ref;
+    if (prev) {
+        ref = prev->next;
+        prev->next = entry->next;
+    } else {
+        ref = bucket_head(ht, index);
+        set_bucket_head(ht, index, entry->next);
+    }
+    return ref;
+}
+
+// Rebuild a bucket summary from its chain after a delete, the caller holds the bucket lock
+void retag_bucket(Hashtable *ht, unsigned int index) {
+#ifdef HASHTABLE_TAGGED_BUCKETS
+    BucketSlot *slot = bucket_slot(ht->table, ht->groups, ht->slot_width, index, 0);
+    if (!slot) return; // Emptied sparse bucket
+    uint64_t tags = *slot & SLOT_REF_MASK;
+    for (Entry *entry = entry_at(ht, bucket_head(ht, index)); entry; entry = entry_at(ht, entry->next)) {
+        tags |= slot_tag(entry->hash);
+    }
+    __atomic_store_n(slot, tags, __ATOMIC_RELAXED);
+#else
+    (void)ht;
+    (void)index;
+#endif
+}
+
+// Push an entry onto a bucket of the table being built, the caller keeps other writers off the bucket
+void link_new_bucket(Hashtable *ht, size_t new_index, EntryRef ref, Entry *entry) {
+    BucketSlot *slot = bucket_slot(ht->new_table, ht->new_groups, ht->new_slot_width, new_index, 1);
+    entry->next = slot_head(slot, ht->new_slot_width, 0);
+    set_slot_head(slot, ht->new_slot_width, 0, ref);
+    tag_slot(slot, 0, entry->hash);
+}
+
+#ifdef HASHTABLE_COMPACT_REFS
+// Rehash arena entries [start, end) into the new table
+// The arena was compacted first, so this is a straight walk in insertion order
+void rehash_chunk(Hashtable *ht, size_t start, size_t end) {
+    int reseeding = ht->new_seed != ht->seed;
+    for (size_t i = start; i < end; i++) {
+        Entry *entry = arena_slot(ht, i);
+        if (reseeding) {
+            entry->hash = hash_key(entry->key, ht->new_seed);
+        }
+        size_t new_index = entry->hash % ht->new_size;
+        if (ht->new_groups) {
+            // Sparse groups repack on insert, so their stripe lock stands in for the CAS
+            pthread_mutex_lock(&ht->new_locks[new_index >> ht->lock_shift]);
+            link_new_bucket(ht, new_index, i + 1, entry);
+            pthread_mutex_unlock(&ht->new_locks[new_index >> ht->lock_shift]);
+        } else {
+            push_slot(ht->new_table, ht->new_slot_width, new_index, i + 1, entry);
+        }
+    }
+}
+#else
+// Rehash buckets [start, end) of the old table into the new one
+void rehash_chunk(Hashtable *ht, size_t start, size_t end) {
+    // When doubling, old bucket i only feeds new buckets i and i + size,
+    // so chunks never share a new bucket and need no locks (sparse groups may still straddle chunks)
+    int reseeding = ht->new_seed != ht->seed;
+    int exclusive = ht->new_size == ht->size * 2 && !reseeding && !ht->new_groups;
+
+    for (size_t i = start; i < end; i++) {
+        EntryRef ref = bucket_head(ht, i);
+        while (ref) {
+            Entry *entry = entry_at(ht, ref);
+            if (reseeding) {
+                entry->hash = hash_key(entry->key, ht->new_seed);
+            }
+            unsigned int new_index = entry->hash % ht->new_size;
+            EntryRef next_ref = entry->next;
+
+            if (!exclusive) pthread_mutex_lock(&ht->new_locks[new_index >> ht->lock_shift]);
+            link_new_bucket(ht, new_index, ref, entry);
+            if (!exclusive) pthread_mutex_unlock(&ht->new_locks[new_index >> ht->lock_shift]);
+
+            ref = next_ref;
+        }
+    }
+}
+#endif
+
+// Claim and rehash chunks until none are left
+void help_rehash(Hashtable *ht) {
+    atomic_fetch_add(&ht->rehash_helpers, 1);
+    if (atomic_load(&ht->state) == TABLE_REHASHING) {
+        size_t chunk;
+        while ((chunk = atomic_fetch_add(&ht->rehash_next, 1)) < ht->rehash_chunks) {
+            size_t start = chunk * REHASH_CHUNK;
+            size_t end = start + REHASH_CHUNK < ht->rehash_items ? start + REHASH_CHUNK : ht->rehash_items;
+            rehash_chunk(ht, start, end);
+            atomic_fetch_add(&ht->rehash_done, 1);
+        }
+    }
+    atomic_fetch_sub(&ht->rehash_helpers, 1);
+}
+
+// Rehash helper thread
+void *rehash_worker(void *arg) {
+    help_rehash((Hashtable *)arg);
+    return NULL;
+}
+
+// Rehash into a new number of buckets under a hash seed, the caller holds the table exclusively
+// Operations arriving meanwhile and the configured helper threads claim chunks too
+void rehash(Hashtable *ht, size_t new_size, uint64_t new_seed) {
+#ifdef HASHTABLE_COMPACT_REFS
+    ht->rehash_items = compact_arena(ht);
+#else
+    ht->rehash_items = ht->size;
+#endif
+    ht->new_slot_width = slot_width(new_size > ht->rehash_items ? new_size : ht->rehash_items);
+    if (ht->groups) {
+        ht->new_groups = calloc(stripe_count(new_size, SPARSE_GROUP_BITS), sizeof(SparseGroup));
+    } else {
+        ht->new_table = calloc(new_size, ht->new_slot_width);
+    }
+    ht->new_locks = malloc(sizeof(pthread_mutex_t) * stripe_count(new_size, ht->lock_shift));
+    ht->new_size = new_size;
+    ht->new_seed = new_seed;
+
+    for (size_t i = 0; i < stripe_count(new_size, ht->lock_shift); i++) {
+        pthread_mutex_init(&ht->new_locks[i], NULL);
+    }
+
+    ht->rehash_chunks = (ht->rehash_items + REHASH_CHUNK - 1) / REHASH_CHUNK;
+    atomic_store(&ht->rehash_next, 0);
+    atomic_store(&ht->rehash_done, 0);
+    atomic_store(&ht->state, TABLE_REHASHING);
+
+    size_t helpers = ht->rehash_threads;
+    if (helpers + 1 > ht->rehash_chunks) helpers = ht->rehash_chunks ? ht->rehash_chunks - 1 : 0;
+    pthread_t *threads = malloc(sizeof(pthread_t) * (helpers + 1));
+    size_t started = 0;
+    while (started < helpers && pthread_create(&threads[started], NULL, rehash_worker, ht) == 0) {
+        started++;
+    }
+
+    help_rehash(ht);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    while (atomic_load(&ht->rehash_done) < ht->rehash_chunks) {
+        sched_yield();
+    }
+
+    // Keep operations out until no thread looks at the old table anymore
+    atomic_store(&ht->state, TABLE_EXCLUSIVE);
+    wait_for_readers(&ht->rehash_helpers);
+
+    // Chains were rebuilt, long ones treeify again on their next insert
+    free_trees(ht);
+    for (size_t i = 0; i < stripe_count(ht->size, ht->lock_shift); i++) {
+        pthread_mutex_destroy(&ht->locks[i]);
+    }
+    free(ht->table);
+    free_groups(ht->groups, ht->size);
+    free(ht->locks);
+
+    ht->table = ht->new_table;
+    ht->groups = ht->new_groups;
+    ht->slot_width = ht->new_slot_width;
+    ht->locks = ht->new_locks;
+    ht->size = new_size;
+    ht->seed = new_seed;
+    ht->new_table = NULL;
+    ht->new_groups = NULL;
+    ht->new_locks = NULL;
+}
+
+// Enter the table as an operation, helping with a rehash in progress first
+void table_enter(Hashtable *ht) {
+    for (;;) {
+        int state = atomic_load(&ht->state);
+        if (state == TABLE_OPEN) {
+            atomic_fetch_add(&ht->active_ops, 1);
+            if (atomic_load(&ht->state) == TABLE_OPEN) return;
+            atomic_fetch_sub(&ht->active_ops, 1);
+        } else if (state == TABLE_REHASHING) {
+            help_rehash(ht);
+        }
+        sched_yield();
+    }
+}
+
+// Leave the table
+void table_leave(Hashtable *ht) {
+    atomic_fetch_sub(&ht->active_ops, 1);
+}
+
+// Take the table exclusively, waiting for running operations to leave
+void table_lock_exclusive(Hashtable *ht) {
+    int state = TABLE_OPEN;
+    while (!atomic_compare_exchange_weak(&ht->state, &state, TABLE_EXCLUSIVE)) {
+        if (state == TABLE_REHASHING) help_rehash(ht);
+        sched_yield();
+        state = TABLE_OPEN;
+    }
+    wait_for_readers(&ht->active_ops);
+}
+
+// Release the table
+void table_unlock_exclusive(Hashtable *ht) {
+    atomic_store(&ht->state, TABLE_OPEN);
+}
+
+// Enter the table and find the bucket of a key
+unsigned int enter_bucket(Hashtable *ht, const char *key, unsigned int *key_hash) {
+    if (ht->warm) {
+        warm_key(ht, key); // Load the key's snapshot segment before anything reads or writes the key
+    }
+    table_enter(ht);
+    *key_hash = hash_key(key, ht->seed);
+    return *key_hash % ht->size;
+}
+
+// Enter the table and lock the bucket of a key
+unsigned int lock_bucket(Hashtable *ht, const char *key, unsigned int *key_hash) {
+    unsigned int index = enter_bucket(ht, key, key_hash);
+    pthread_mutex_lock(bucket_lock(ht, index));
+    return index;
+}
+
+// Unlock a bucket and leave the table
+void unlock_bucket(Hashtable *ht, unsigned int index) {
+    pthread_mutex_unlock(bucket_lock(ht, index));
+    table_leave(ht);
+}
+
+// Enter the table and find the bucket of a key before a deadline, NULL waits as long as it takes
+// A deadline-bound caller waits out a rehash or exclusive holder instead of helping it
+// Returns 0, or DB_BUSY once the deadline passes
+int enter_bucket_until(Hashtable *ht, const char *key, unsigned int *key_hash, unsigned int *index, const struct timespec *deadline) {
+    if (!deadline) {
+        *index = enter_bucket(ht, key, key_hash);
+        return 0;
+    }
+
+    if (ht->warm && warm_key_until(ht, key, deadline)) {
+        return DB_BUSY;
+    }
+    struct timespec left;
+    for (;;) {
+        if (atomic_load(&ht->state) == TABLE_OPEN) {
+            atomic_fetch_add(&ht->active_ops, 1);
+            if (atomic_load(&ht->state) == TABLE_OPEN) break;
+            atomic_fetch_sub(&ht->active_ops, 1);
+        }
+        if (!time_left(deadline, &left)) return DB_BUSY;
+        sched_yield();
+    }
+    *key_hash = hash_key(key, ht->seed);
+    *index = *key_hash % ht->size;
+    return 0;
+}
+
+// Lock an entered bucket before a deadline, spinning on trylock, NULL waits as long as it takes
+// Returns 0, or DB_BUSY after leaving the table once the deadline passes
+int lock_bucket_until(Hashtable *ht, unsigned int index, const struct timespec *deadline) {
+    pthread_mutex_t *lock = bucket_lock(ht, index);
+    if (!deadline) {
+        pthread_mutex_lock(lock);
+        return 0;
+    }
+
+    struct timespec left;
+    for (unsigned int attempt = 1; pthread_mutex_trylock(lock) != 0; attempt++) {
+        if (!time_left(deadline, &left)) {
+            table_leave(ht);
+            return DB_BUSY;
+        }
+        if (attempt >= TRY_LOCK_SPINS) sched_yield();
+    }
+    return 0;
+}
+
+// Resize the hashtable to at least a given number of buckets
+void resize_to(Hashtable *ht, size_t new_size) {
+    table_lock_exclusive(ht);
+    if (new_size > ht->size) {
+        rehash(ht, new_size, ht->seed);
+    }
+    table_unlock_exclusive(ht);
+}
+
+// Entries the load factor is measured on, compact builds count arena holes too
+size_t table_load(Hashtable *ht) {
+#ifdef HASHTABLE_COMPACT_REFS
+    return atomic_load(&ht->arena_next);
+#else
+    return ht->count;
+#endif
+}
+
+// Whether the table should rehash before taking more entries
+int needs_resize(Hashtable *ht) {
+    return (double)table_load(ht) / ht->size > LOAD_FACTOR_THRESHOLD
+        || table_load(ht) >= slot_ref_limit(ht->slot_width);
+}
+
+// Resize the hashtable
+// A table mostly full of arena holes is only compacted, keeping its bucket count
+void resize(Hashtable *ht) {
+    table_lock_exclusive(ht);
+    if (needs_resize(ht)) { // Another thread may have resized already
+        int grow = (double)ht->count / ht->size > LOAD_FACTOR_THRESHOLD / 2;
+        rehash(ht, grow ? ht->size * 2 : ht->size, ht->seed);
+    }
+    table_unlock_exclusive(ht);
+}
+
+// Longest chain expected for the bucket count, with a wide margin
+// (the expected maximum grows like ln n / ln ln n)
+size_t chain_bound(size_t size) {
+    size_t bits = 0;
+    while (size) {
+        bits++;
+        size >>= 1;
+    }
+    return RESEED_CHAIN_FACTOR * bits;
+}
+
+// Pick a fresh, non-zero hash seed
+uint64_t random_seed(Hashtable *ht) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t seed = mix64(((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ (uint64_t)(uintptr_t)ht ^ ht->seed);
+    return seed ? seed : 1;
+}
+
+// Pick a new hash seed and rebuild the table through the rehash path
+// Only once per doubling of the count, so keys that collide under every seed cannot loop
+void reseed(Hashtable *ht) {
+    table_lock_exclusive(ht);
+    if (ht->count > ht->reseed_count * 2) {
+        ht->reseed_count = ht->count;
+        rehash(ht, ht->size, random_seed(ht));
+    }
+    table_unlock_exclusive(ht);
+}
+
+// Set the number of helper threads started for each rehash
+void db_set_rehash_threads(Hashtable *ht, unsigned int threads) {
+    ht->rehash_threads = threads;
+}
+
+// Bytes allocated for the value of an entry: its size, or the next power of two once it was grown in place
+// Grown buffers only get longer until they are replaced, so this never overstates the allocation
+size_t value_capacity(const Entry *entry) {
+    size_t capacity = entry->value_size;
+    if (entry->grown && capacity > 1) {
+        capacity = (size_t)1 << (8 * sizeof(unsigned long long) - __builtin_clzll(capacity - 1));
+    }
+    return capacity;
+}
+
+// Make room for a value of at least size bytes, growing the buffer to a power of two when it has to move,
+// which at least doubles it
+void reserve_value(Entry *entry, size_t size) {
+    if (size <= value_capacity(entry)) return;
+    size_t capacity = 1;
+    while (capacity < size) capacity *= 2;
+    entry->value = realloc(entry->value, capacity);
+    entry->grown = 1;
+}
+
+// Total length of an iovec array
+size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+    return length;
+}
+
+// Copy the buffers of an iovec array back to back into dest
+void iov_gather(char *dest, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len) memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+}
+
+// Copy up to size bytes from src into the buffers of an iovec array in order, returns the bytes copied
+size_t iov_scatter(const struct iovec *iov, int iovcnt, const char *src, size_t size) {
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < size; i++) {
+        size_t part = iov[i].iov_len < size - copied ? iov[i].iov_len : size - copied;
+        if (part) memcpy(iov[i].iov_base, src + copied, part);
+        copied += part;
+    }
+    return copied;
+}
+
+// Next entry version of a table, never 0 so a missing key can report version 0
+uint64_t next_version(Hashtable *ht) {
+    return atomic_fetch_add(&ht->version_clock, 1) + 1;
+}
+
+// Wake the db_wait callers of a key's stripe after a change to it, a single load when nobody waits
+// Called after the change is made under the bucket lock, so a waiter either sees it or gets woken
+void notify_key(Hashtable *ht, const char *key) {
+    if (atomic_load(&ht->waiting) == 0) {
+        return;
+    }
+    atomic_uint *word = &ht->wait_seq[hash_key(key, 0) % WAIT_STRIPES];
+    atomic_fetch_add(word, 1);
+    wake_word(word);
+}
+
+// Bytes a log record takes, key and value padded to 8 bytes
+size_t log_record_size(size_t key_length, size_t value_capacity) {
+    return sizeof(LogRecord) + ((key_length + 7) & ~(size_t)7) + ((value_capacity + 7) & ~(size_t)7);
+}
+
+// Offset of the value in a log record
+size_t log_value_offset(size_t key_length) {
+    return sizeof(LogRecord) + ((key_length + 7) & ~(size_t)7);
+}
+
+// Memory of a resident log address, the caller is inside the log epoch
+char *log_memory(HybridLog *log, uint64_t address) {
+    size_t frame = (address >> LOG_PAGE_BITS) % log->frame_count;
+    return log->frames + (frame << LOG_PAGE_BITS) + (address & (LOG_PAGE_SIZE - 1));
+}
+
+// Enter the log epoch, pages cannot be evicted or flushed under an operation inside it
+int log_protect(HybridLog *log) {
+    int epoch = atomic_load(&log->version_index);
+    atomic_fetch_add(&log->readers[epoch], 1);
+    return epoch;
+}
+
+// Leave the log epoch
+void log_unprotect(HybridLog *log, int epoch) {
+    atomic_fetch_sub(&log->readers[epoch], 1);
+}
+
+// Copy bytes out of the log, from memory while their page is resident or from the file otherwise
+// A record never spans pages, so the record's address decides for all of its bytes
+void log_read(HybridLog *log, uint64_t address, void *dest, size_t len) {
+    if (address >= atomic_load(&log->head)) {
+        memcpy(dest, log_memory(log, address), len);
+    } else if (pread(log->fd, dest, len, (off_t)address) != (ssize_t)len) {
+        perror("Failed to read from log file");
+        memset(dest, 0, len);
+    }
+}
+
+// Newest record of a key in an index bucket, 0 if there is none; *record receives its header
+// The caller holds the bucket lock and is inside the log epoch
+uint64_t log_find(HybridLog *log, unsigned int index, unsigned int key_hash, const char *key, LogRecord *record) {
+    size_t key_length = strlen(key) + 1;
+    char small[64];
+    char *stored = key_length <= sizeof(small) ? small : malloc(key_length);
+    uint64_t address;
+    uint64_t begin = atomic_load(&log->begin);
+    for (address = log->index[index]; address >= begin; address = record->prev) {
+        log_read(log, address, record, sizeof(LogRecord));
+        if (record->hash != key_hash || record->key_length != key_length) continue;
+        log_read(log, address + sizeof(LogRecord), stored, key_length);
+        if (memcmp(stored, key, key_length) == 0) break;
+    }
+    if (stored != small) free(stored);
+    return address >= begin ? address : 0;
+}
+
+// Reserve size bytes at the log tail, 0 if they do not fit in the tail page
+// An allocation never ends on a page boundary, so only a page turn moves the tail onto a new page
+uint64_t log_alloc(HybridLog *log, size_t size) {
+    uint64_t tail = atomic_load(&log->tail);
+    do {
+        if ((tail & (LOG_PAGE_SIZE - 1)) + size >= LOG_PAGE_SIZE) return 0;
+    } while (!atomic_compare_exchange_weak(&log->tail, &tail, tail + size));
+    return tail;
+}
+
+// Move the tail onto a new page once a record of size bytes no longer fits in the tail page
+// Evicts the oldest resident page, then turns older pages read-only and writes them to the file
+// Called outside the log epoch and without a bucket lock, the epoch waits below would deadlock otherwise
+void log_turn_page(HybridLog *log, size_t size) {
+    pthread_mutex_lock(&log->tail_lock);
+    uint64_t tail = atomic_load(&log->tail);
+    if ((tail & (LOG_PAGE_SIZE - 1)) + size >= LOG_PAGE_SIZE) {
+        uint64_t next = (tail >> LOG_PAGE_BITS) + 1;
+        if (next >= log->frame_count) {
+            // The frame's previous page turned read-only and was flushed on an earlier turn
+            atomic_store(&log->head, (next - log->frame_count + 1) << LOG_PAGE_BITS);
+            synchronize_readers(&log->version_index, log->readers);
+        }
+        memset(log_memory(log, next << LOG_PAGE_BITS), 0, LOG_PAGE_SIZE); // A zero header ends the page's records
+        atomic_store(&log->tail, next << LOG_PAGE_BITS);
+
+        if (next + 1 > log->mutable_pages) {
+            uint64_t read_only = (next + 1 - log->mutable_pages) << LOG_PAGE_BITS;
+            atomic_store(&log->read_only, read_only);
+            synchronize_readers(&log->version_index, log->readers); // Writers may still be updating those pages in place
+            for (; log->flushed < read_only; log->flushed += LOG_PAGE_SIZE) {
+                if (pwrite(log->fd, log_memory(log, log->flushed), LOG_PAGE_SIZE, (off_t)log->flushed) != (ssize_t)LOG_PAGE_SIZE) {
+                    perror("Failed to write to log file");
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&log->tail_lock);
+}
+
+// Insert, update or append to a key of a hybrid log table
+// A live record in the mutable region with room for the value is updated in place, otherwise
+// a new record is appended at the tail and the index bucket pointed at it (copy-on-write)
+int log_write(Hashtable *ht, const char *key, const struct iovec *iov, int iovcnt, int append, const struct timespec *deadline) {
+    HybridLog *log = ht->log;
+    size_t key_length = strlen(key) + 1, value_size = iov_length(iov, iovcnt);
+    for (;;) {
+        unsigned int key_hash, index;
+        if (enter_bucket_until(ht, key, &key_hash, &index, deadline) || lock_bucket_until(ht, index, deadline)) {
+            return DB_BUSY;
+        }
+        int epoch = log_protect(log);
+        LogRecord found;
+        uint64_t address = log_find(log, index, key_hash, key, &found);
+        int live = address && !(found.flags & LOG_TOMBSTONE);
+        size_t kept = live && append ? found.value_size : 0; // Old value bytes that stay in front
+        size_t needed = kept + value_size;
+
+        if (live && address >= atomic_load(&log->read_only) && needed <= found.value_capacity) {
+            LogRecord *record = (LogRecord *)log_memory(log, address);
+            iov_gather((char *)record + log_value_offset(key_length) + kept, iov, iovcnt);
+            record->value_size = needed;
+            record->version = next_version(ht);
+            log_unprotect(log, epoch);
+            unlock_bucket(ht, index);
+            notify_key(ht, key);
+            return 0; // Updated in place
+        }
+
+        // Appends reserve room to grow in place while the record stays mutable
+        size_t capacity = append && log_record_size(key_length, needed * 2) < LOG_PAGE_SIZE ? needed * 2 : needed;
+        size_t size = log_record_size(key_length, capacity);
+        uint64_t new_address = size < LOG_PAGE_SIZE ? log_alloc(log, size) : 0;
+        if (!new_address) {
+            log_unprotect(log, epoch);
+            unlock_bucket(ht, index);
+            if (size >= LOG_PAGE_SIZE) {
+                return -1; // Records must fit in a page
+            }
+            log_turn_page(log, size);
+            continue;
+        }
+
+        LogRecord *record = (LogRecord *)log_memory(log, new_address);
+        record->prev = log->index[index];
+        record->version = next_version(ht);
+        record->hash = key_hash;
+        record->flags = 0;
+        record->key_length = key_length;
+        record->value_size = needed;
+        record->value_capacity = capacity;
+        memcpy(record + 1, key, key_length);
+        char *value = (char *)record + log_value_offset(key_length);
+        if (kept) log_read(log, address + log_value_offset(key_length), value, kept);
+        iov_gather(value + kept, iov, iovcnt);
+        log->index[index] = new_address;
+        if (!live) ht->count++;
+        log_unprotect(log, epoch);
+        unlock_bucket(ht, index);
+        notify_key(ht, key);
+        return 0; // Success
+    }
+}
+
+// Lookup a key of a hybrid log table, reading it from the file if its page was evicted
+int log_lookup(Hashtable *ht, const char *key, void **value, size_t *value_size, const struct timespec *deadline) {
+    HybridLog *log = ht->log;
+    unsigned int key_hash, index;
+    if (enter_bucket_until(ht, key, &key_hash, &index, deadline) || lock_bucket_until(ht, index, deadline)) {
+        return DB_BUSY;
+    }
+    int epoch = log_protect(log);
+    LogRecord found;
+    uint64_t address = log_find(log, index, key_hash, key, &found);
+    int rc = -1; // Key not found
+    if (address && !(found.flags & LOG_TOMBSTONE)) {
+        *value_size = found.value_size;
+        *value = malloc(found.value_size ? found.value_size : 1);
+        log_read(log, address + log_value_offset(found.key_length), *value, found.value_size);
+        rc = 0;
+    }
+    log_unprotect(log, epoch);
+    unlock_bucket(ht, index);
+    return rc;
+}
+
+// Delete a key of a hybrid log table, marking a mutable record in place or appending a tombstone
+int log_delete(Hashtable *ht, const char *key, const struct timespec *deadline) {
+    HybridLog *log = ht->log;
+    size_t key_length = strlen(key) + 1;
+    for (;;) {
+        unsigned int key_hash, index;
+        if (enter_bucket_until(ht, key, &key_hash, &index, deadline) || lock_bucket_until(ht, index, deadline)) {
+            return DB_BUSY;
+        }
+        int epoch = log_protect(log);
+        LogRecord found;
+        uint64_t address = log_find(log, index, key_hash, key, &found);
+        int rc = -1; // Key not found
+        if (address && !(found.flags & LOG_TOMBSTONE)) {
+            if (address >= atomic_load(&log->read_only)) {
+                LogRecord *record = (LogRecord *)log_memory(log, address);
+                record->flags |= LOG_TOMBSTONE;
+                record->version = next_version(ht);
+            } else {
+                size_t size = log_record_size(key_length, 0);
+                uint64_t new_address = log_alloc(log, size);
+                if (!new_address) {
+                    log_unprotect(log, epoch);
+                    unlock_bucket(ht, index);
+                    log_turn_page(log, size);
+                    continue;
+                }
+                LogRecord *record = (LogRecord *)log_memory(log, new_address);
+                record->prev = log->index[index];
+                record->version = next_version(ht);
+                record->hash = key_hash;
+                record->flags = LOG_TOMBSTONE;
+                record->key_length = key_length;
+                record->value_size = 0;
+                record->value_capacity = 0;
+                memcpy(record + 1, key, key_length);
+                log->index[index] = new_address;
+            }
+            ht->count--;
+            rc = 0;
+        }
+        log_unprotect(log, epoch);
+        unlock_bucket(ht, index);
+        if (rc == 0) notify_key(ht, key);
+        return rc;
+    }
+}
+
+// Version of a key of a hybrid log table, 0 if the key is missing
+uint64_t log_version(Hashtable *ht, const char *key) {
+    HybridLog *log = ht->log;
+    unsigned int key_hash;
+    unsigned int index = enter_bucket(ht, key, &key_hash);
+    pthread_mutex_lock(bucket_lock(ht, index));
+    int epoch = log_protect(log);
+    LogRecord found;
+    uint64_t address = log_find(log, index, key_hash, key, &found);
+    log_unprotect(log, epoch);
+    unlock_bucket(ht, index);
+    return address && !(found.flags & LOG_TOMBSTONE) ? found.version : 0;
+}
+
+// Empty a hybrid log table, the caller holds the table exclusively
+// The index is zeroed and the log starts over at its first page, the file is truncated
+void log_clear(Hashtable *ht) {
+    HybridLog *log = ht->log;
+    pthread_mutex_lock(&log->tail_lock); // A writer may be turning a page outside the table
+    memset(log->index, 0, sizeof(uint64_t) * ht->size);
+    memset(log_memory(log, LOG_PAGE_SIZE), 0, LOG_PAGE_SIZE);
+    atomic_store(&log->begin, LOG_PAGE_SIZE);
+    atomic_store(&log->tail, LOG_PAGE_SIZE);
+    atomic_store(&log->read_only, 0);
+    atomic_store(&log->head, 0);
+    log->flushed = 0;
+    if (ftruncate(log->fd, 0) != 0) {
+        perror("Failed to truncate log file");
+    }
+    ht->count = 0;
+    pthread_mutex_unlock(&log->tail_lock);
+}
+
+// Copy the record of a key at an address to the tail if it is still the key's newest live record,
+// so its page can be truncated. Returns 0 once the record is dead or copied, or the record size if
+// the tail page is full and has to turn first
+size_t log_copy_forward(Hashtable *ht, uint64_t address, const char *key) {
+    HybridLog *log = ht->log;
+    unsigned int key_hash;
+    unsigned int index = enter_bucket(ht, key, &key_hash);
+    pthread_mutex_lock(bucket_lock(ht, index));
+    int epoch = log_protect(log);
+    LogRecord found;
+    size_t rc = 0;
+    if (log_find(log, index, key_hash, key, &found) == address && !(found.flags & LOG_TOMBSTONE)) {
+        size_t size = log_record_size(found.key_length, found.value_size);
+        uint64_t new_address = log_alloc(log, size);
+        if (new_address) {
+            LogRecord *record = (LogRecord *)log_memory(log, new_address);
+            log_read(log, address, record, log_value_offset(found.key_length) + found.value_size);
+            record->prev = log->index[index];
+            record->value_capacity = found.value_size;
+            log->index[index] = new_address; // Same version, the key did not change
+        } else {
+            rc = size;
+        }
+    }
+    log_unprotect(log, epoch);
+    unlock_bucket(ht, index);
+    return rc;
+}
+
+// Compact up to pages of the oldest read-only log pages and truncate them
+// Records that are still the newest live version of their key are copied to the tail, then the pages are
+// dropped: chains stop at them and the file space is released (punched out on Linux), so lookups and
+// misses no longer walk that history. Runs alongside other operations. Returns the pages truncated
+size_t db_log_compact(Hashtable *ht, size_t pages) {
+    HybridLog *log = ht->log;
+    if (!log) {
+        return 0; // Only log tables have pages
+    }
+    pthread_mutex_lock(&log->compact_lock);
+    uint64_t begin = atomic_load(&log->begin), until = begin;
+    // Only pages flushed before the call: no writer is still filling in or updating a record of theirs in place,
+    // and the pages the copied records fill are left for the next call
+    pthread_mutex_lock(&log->tail_lock);
+    uint64_t flushed = log->flushed;
+    pthread_mutex_unlock(&log->tail_lock);
+    char *page = malloc(LOG_PAGE_SIZE);
+    for (; pages > 0 && until + LOG_PAGE_SIZE <= flushed; pages--, until += LOG_PAGE_SIZE) {
+        int epoch = log_protect(log);
+        log_read(log, until, page, LOG_PAGE_SIZE);
+        log_unprotect(log, epoch);
+        for (size_t offset = 0; offset + sizeof(LogRecord) <= LOG_PAGE_SIZE;) {
+            const LogRecord *record = (const LogRecord *)(page + offset);
+            if (record->key_length == 0) break; // The rest of the page was never written
+            size_t size;
+            while ((size = log_copy_forward(ht, until + offset, page + offset + sizeof(LogRecord))) != 0) {
+                log_turn_page(log, size);
+            }
+            offset += log_record_size(record->key_length, record->value_capacity);
+        }
+    }
+    free(page);
+
+    if (until > begin) {
+        // Readers that loaded the old begin may still walk into the pages, wait for them before releasing
+        pthread_mutex_lock(&log->tail_lock);
+        atomic_store(&log->begin, until);
+        synchronize_readers(&log->version_index, log->readers);
+        pthread_mutex_unlock(&log->tail_lock);
+#ifdef __linux__
+        syscall(SYS_fallocate, log->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)begin, (off_t)(until - begin));
+#endif
+    }
+    pthread_mutex_unlock(&log->compact_lock);
+    return (until - begin) >> LOG_PAGE_BITS;
+}
+
+// Insert or update a key in a bucket with a value gathered from an iovec array, the caller holds the bucket lock
+// With append set, an existing value is extended in place instead of replaced
+// Returns the bucket length after adding a new key, 0 after updating one,
+// SIZE_MAX when the table must rehash before it can take the key
+size_t insert_entry(Hashtable *ht, unsigned int index, unsigned int key_hash, const char *key, const struct iovec *iov, int iovcnt, int append) {
+    size_t value_size = iov_length(iov, iovcnt);
+    BucketTree *tree = bucket_tree(ht, index);
+    size_t position = 0, length = 0;
+    Entry *entry = NULL;
+    if (tree) {
+        int found;
+        position = tree_search(tree, key_hash, key, &found);
+        if (found) entry = tree->entries[position];
+    } else {
+        for (Entry *chained = entry_at(ht, bucket_head(ht, index)); chained && !entry; chained = entry_at(ht, chained->next), length++) {
+            if (chained->hash == key_hash && strcmp(chained->key, key) == 0) entry = chained;
+        }
+    }
+
+    if (entry) {
+        if (ht->flags & DB_SET) {
+            return 0;
+        }
+        entry->version = next_version(ht);
+        if (append) {
+            reserve_value(entry, entry->value_size + value_size);
+            iov_gather((char *)entry->value + entry->value_size, iov, iovcnt);
+            entry->value_size += value_size;
+        } else {
+            free(entry->value);
+            entry->value = malloc(value_size);
+            iov_gather(entry->value, iov, iovcnt);
+            entry->value_size = value_size;
+            entry->grown = 0;
+        }
+        return 0;
+    }
+
+    Entry *new_entry;
+    EntryRef new_ref = alloc_entry(ht, &new_entry);
+    if (!new_ref) {
+        return SIZE_MAX; // Out of entry references
+    }
+    new_entry->key = strdup(key);
+    new_entry->hash = key_hash;
+    new_entry->hits = 0;
+    new_entry->version = next_version(ht);
+    new_entry->grown = 0;
+    if (!(ht->flags & DB_SET)) {
+        new_entry->value = malloc(value_size);
+        iov_gather(new_entry->value, iov, iovcnt);
+        new_entry->value_size = value_size;
+    }
+    ht->count++;
+
+    if (!tree) {
+        link_entry(ht, index, NULL, new_ref, new_entry);
+        if (length + 1 >= TREEIFY_THRESHOLD && !(ht->flags & DB_SPARSE)) {
+            treeify(ht, index, length + 1); // Sparse tables skip the per-bucket tree array and rely on reseeding
+        }
+        return length + 1;
+    }
+
+    // Keep the tree sorted and the chain linked in tree order
+    if (tree->count == tree->capacity) {
+        tree->capacity *= 2;
+        tree = realloc(tree, sizeof(BucketTree) + sizeof(Entry *) * tree->capacity);
+        atomic_load(&ht->trees)[index] = tree;
+    }
+    link_entry(ht, index, position > 0 ? tree->entries[position - 1] : NULL, new_ref, new_entry);
+    memmove(&tree->entries[position + 1], &tree->entries[position], sizeof(Entry *) * (tree->count - position));
+    tree->entries[position] = new_entry;
+    tree->count++;
+    return tree->count;
+}
+
+// Insert, update or append to a key under one bucket lock, then grow or reseed the table if needed
+// The deadline bounds waiting on other threads, NULL waits as long as it takes
+// Returns 0, or DB_BUSY once the deadline passes
+int write_key(Hashtable *ht, const char *key, const struct iovec *iov, int iovcnt, int append, const struct timespec *deadline) {
+    if (ht->log) {
+        return log_write(ht, key, iov, iovcnt, append, deadline);
+    }
+    for (;;) {
+        unsigned int key_hash, index;
+        if (enter_bucket_until(ht, key, &key_hash, &index, deadline) || lock_bucket_until(ht, index, deadline)) {
+            return DB_BUSY;
+        }
+        size_t length = insert_entry(ht, index, key_hash, key, iov, iovcnt, append);
+        int grow = needs_resize(ht);
+        int pathological = length > chain_bound(ht->size);
+        unlock_bucket(ht, index);
+
+        if (grow) {
+            resize(ht);
+        } else if (pathological) {
+            reseed(ht);
+        }
+        if (length != SIZE_MAX) {
+            notify_key(ht, key);
+            return 0; // Success
+        }
+    }
+}
+
+// Order pending writes by bucket, which also groups them by lock stripe
+int pending_write_compare(const void *a, const void *b) {
+    unsigned int x = ((const PendingWrite *)a)->index, y = ((const PendingWrite *)b)->index;
+    return (x > y) - (x < y);
+}
+
+// Write a buffer's pending writes to its table, taking each lock stripe once for all of its keys
+// The caller holds the buffer lock
+void flush_buffer(WriteBuffer *buffer) {
+    Hashtable *ht = buffer->ht, *pending = buffer->pending;
+    size_t count = atomic_load(&pending->count);
+    if (count == 0) {
+        return;
+    }
+
+    PendingWrite *writes = malloc(sizeof(PendingWrite) * (count + 1));
+    EntryCursor cursor = {0, NULL};
+    size_t retry = 0;
+    while ((writes[retry].entry = next_entry(pending, &cursor))) {
+        retry++;
+    }
+    for (size_t i = 0; ht->warm && i < count; i++) {
+        warm_key(ht, writes[i].entry->key); // The batch bypasses enter_bucket
+    }
+    if (!ht->log) {
+        table_enter(ht);
+        for (size_t i = 0; i < count; i++) {
+            writes[i].key_hash = hash_key(writes[i].entry->key, ht->seed);
+            writes[i].index = writes[i].key_hash % ht->size;
+        }
+        qsort(writes, count, sizeof(PendingWrite), pending_write_compare);
+
+        int grow = 0, pathological = 0;
+        retry = 0;
+        for (size_t i = 0; i < count;) {
+            pthread_mutex_t *lock = bucket_lock(ht, writes[i].index);
+            pthread_mutex_lock(lock);
+            for (; i < count && bucket_lock(ht, writes[i].index) == lock; i++) {
+                Entry *entry = writes[i].entry;
+                struct iovec part = {entry->value, entry->value_size};
+                size_t length = insert_entry(ht, writes[i].index, writes[i].key_hash, entry->key, &part, 1, 0);
+                if (length == SIZE_MAX) {
+                    writes[retry++] = writes[i]; // Out of entry references, written one by one below
+                } else if (length > chain_bound(ht->size)) {
+                    pathological = 1;
+                }
+            }
+            grow |= needs_resize(ht);
+            pthread_mutex_unlock(lock);
+        }
+        table_leave(ht);
+
+        if (grow) {
+            resize(ht);
+        } else if (pathological) {
+            reseed(ht);
+        }
+    }
+    for (size_t i = 0; i < retry; i++) {
+        struct iovec part = {writes[i].entry->value, writes[i].entry->value_size};
+        write_key(ht, writes[i].entry->key, &part, 1, 0, NULL);
+    }
+    free(writes);
+
+    Entry *entry;
+    cursor = (EntryCursor){0, NULL};
+    while (atomic_load(&ht->waiting) && (entry = next_entry(pending, &cursor))) {
+        notify_key(ht, entry->key);
+    }
+    free_hashtable(pending);
+    buffer->pending = create_hashtable(INITIAL_TABLE_SIZE);
+}
+
+// Free a write buffer, its writes must already be flushed
+void free_buffer(WriteBuffer *buffer) {
+    free_hashtable(buffer->pending);
+    pthread_mutex_destroy(&buffer->lock);
+    free(buffer);
+}
+
+// Flush the write buffer of an exiting thread (pthread key destructor)
+void release_buffer(void *arg) {
+    WriteBuffer *buffer = arg;
+    WriteBehind *wb = buffer->ht->write_behind;
+    pthread_mutex_lock(&wb->lock);
+    WriteBuffer **link = &wb->buffers;
+    while (*link != buffer) {
+        link = &(*link)->next;
+    }
+    *link = buffer->next;
+    pthread_mutex_unlock(&wb->lock);
+
+    pthread_mutex_lock(&buffer->lock);
+    flush_buffer(buffer);
+    pthread_mutex_unlock(&buffer->lock);
+    free_buffer(buffer);
+}
+
+// Write buffer of the calling thread, created on its first buffered write
+WriteBuffer *own_buffer(Hashtable *ht) {
+    WriteBehind *wb = ht->write_behind;
+    WriteBuffer *buffer = pthread_getspecific(wb->key);
+    if (buffer) {
+        return buffer;
+    }
+
+    buffer = malloc(sizeof(WriteBuffer));
+    buffer->ht = ht;
+    buffer->pending = create_hashtable(INITIAL_TABLE_SIZE);
+    pthread_mutex_init(&buffer->lock, NULL);
+    pthread_mutex_lock(&wb->lock);
+    buffer->next = wb->buffers;
+    wb->buffers = buffer;
+    pthread_mutex_unlock(&wb->lock);
+    pthread_setspecific(wb->key, buffer);
+    return buffer;
+}
+
+// Write buffer of the calling thread, NULL if it has none
+WriteBuffer *thread_buffer(Hashtable *ht) {
+    return ht->write_behind ? pthread_getspecific(ht->write_behind->key) : NULL;
+}
+
+// Buffered write of a key, NULL if there is none; the caller holds the buffer lock
+Entry *buffered_write(WriteBuffer *buffer, const char *key) {
+    Hashtable *pending = buffer->pending;
+    unsigned int key_hash = hash_key(key, pending->seed);
+    return find_entry(pending, key_hash % pending->size, key_hash, key);
+}
+
+// Lock a write buffer before a deadline, NULL waits as long as it takes
+// The flusher thread holds the lock for a whole flush, so deadline-bound callers only try it
+// Returns 0, or DB_BUSY once the deadline passes
+int lock_buffer_until(WriteBuffer *buffer, const struct timespec *deadline) {
+    if (!deadline) {
+        pthread_mutex_lock(&buffer->lock);
+        return 0;
+    }
+
+    struct timespec left;
+    for (unsigned int attempt = 1; pthread_mutex_trylock(&buffer->lock) != 0; attempt++) {
+        if (!time_left(deadline, &left)) {
+            return DB_BUSY;
+        }
+        if (attempt >= TRY_LOCK_SPINS) sched_yield();
+    }
+    return 0;
+}
+
+// Flush the calling thread's write buffer, so its other operations see and order after its buffered writes
+// Deadline-bound writes do not flush, as a flush takes stripe locks and may resize without bound; they hold
+// the buffer lock instead and drop the key's buffered write once their own write of the key lands
+void settle_buffer(Hashtable *ht) {
+    WriteBuffer *buffer = thread_buffer(ht);
+    if (buffer) {
+        pthread_mutex_lock(&buffer->lock);
+        flush_buffer(buffer);
+        pthread_mutex_unlock(&buffer->lock);
+    }
+}
+
+// Drop the calling thread's buffered writes without writing them
+void discard_buffer(Hashtable *ht) {
+    WriteBuffer *buffer = thread_buffer(ht);
+    if (buffer) {
+        pthread_mutex_lock(&buffer->lock);
+        free_hashtable(buffer->pending);
+        buffer->pending = create_hashtable(INITIAL_TABLE_SIZE);
+        pthread_mutex_unlock(&buffer->lock);
+    }
+}
+
+// Buffer a blind write in the calling thread's write buffer, flushing it once max_pending keys wait
+// Repeated writes to a key replace each other in the buffer, so only the newest reaches the table
+int buffer_write(Hashtable *ht, const char *key, void *value, size_t value_size) {
+    WriteBehind *wb = ht->write_behind;
+    WriteBuffer *buffer = own_buffer(ht);
+    pthread_mutex_lock(&buffer->lock);
+    if (atomic_load(&buffer->pending->count) == 0) {
+        buffer->flush_at = deadline_after(wb->interval_ms);
+    }
+    struct iovec part = {value, value_size};
+    write_key(buffer->pending, key, &part, 1, 0, NULL);
+    if (atomic_load(&buffer->pending->count) >= wb->max_pending) {
+        flush_buffer(buffer);
+    }
+    pthread_mutex_unlock(&buffer->lock);
+    return 0; // Success
+}
+
+// Flush write buffers whose oldest write is due, twice per interval
+void *write_behind_worker(void *arg) {
+    WriteBehind *wb = ((Hashtable *)arg)->write_behind;
+    pthread_mutex_lock(&wb->lock);
+    while (!wb->stop) {
+        struct timespec wake = deadline_after(wb->interval_ms / 2 + 1);
+        pthread_cond_timedwait(&wb->wake, &wb->lock, &wake);
+        for (WriteBuffer *buffer = wb->buffers; buffer && !wb->stop; buffer = buffer->next) {
+            struct timespec left;
+            pthread_mutex_lock(&buffer->lock);
+            if (atomic_load(&buffer->pending->count) && !time_left(&buffer->flush_at, &left)) {
+                flush_buffer(buffer);
+            }
+            pthread_mutex_unlock(&buffer->lock);
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+// Buffer db_insert calls per thread and write them in batches, one lock per stripe per batch
+// A batch is written once max_pending keys wait, once the oldest has waited interval_ms (0 for no time bound),
+// on db_flush, when the thread exits and when the table is closed
+// Call before the table is shared; returns -1 if write-behind is already on
+int db_write_behind(Hashtable *ht, size_t max_pending, long interval_ms) {
+    if (ht->write_behind) {
+        return -1;
+    }
+    WriteBehind *wb = malloc(sizeof(WriteBehind));
+    if (pthread_key_create(&wb->key, release_buffer) != 0) {
+        free(wb);
+        return -1;
+    }
+    wb->max_pending = max_pending ? max_pending : 1;
+    wb->interval_ms = interval_ms > 0 ? interval_ms : 0;
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wb->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    wb->buffers = NULL;
+    wb->stop = 0;
+    ht->write_behind = wb;
+    if (wb->interval_ms && pthread_create(&wb->flusher, NULL, write_behind_worker, ht) != 0) {
+        wb->interval_ms = 0; // Only max_pending and db_flush bound staleness then
+    }
+    return 0; // Success
+}
+
+// Write the calling thread's buffered writes to the table now
+int db_flush(Hashtable *ht) {
+    settle_buffer(ht);
+    return 0; // Success
+}
+
+// Stop write-behind, writing every thread's buffered writes, no thread may still be using the table
+void stop_write_behind(Hashtable *ht) {
+    WriteBehind *wb = ht->write_behind;
+    if (wb->interval_ms) {
+        pthread_mutex_lock(&wb->lock);
+        wb->stop = 1;
+        pthread_cond_signal(&wb->wake);
+        pthread_mutex_unlock(&wb->lock);
+        pthread_join(wb->flusher, NULL);
+    }
+    pthread_key_delete(wb->key); // Exiting threads no longer flush their buffers
+
+    while (wb->buffers) {
+        WriteBuffer *buffer = wb->buffers;
+        wb->buffers = buffer->next;
+        flush_buffer(buffer);
+        free_buffer(buffer);
+    }
+    pthread_cond_destroy(&wb->wake);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb);
+    ht->write_behind = NULL;
+}
+
+// Insert or update a key-value pair
+int db_insert(Hashtable *ht, const char *key, void *value, size_t value_size) {
+    if (ht->write_behind) {
+        return buffer_write(ht, key, value, value_size);
+    }
+    struct iovec part = {value, value_size};
+    return write_key(ht, key, &part, 1, 0, NULL);
+}
+
+// Insert or update a key-value pair, giving up with DB_BUSY if the bucket is not free before an absolute
+// CLOCK_MONOTONIC deadline (see deadline_after). A write that grows the table still finishes the rehash
+int db_try_insert(Hashtable *ht, const char *key, void *value, size_t value_size, const struct timespec *deadline) {
+    WriteBuffer *buffer = deadline ? thread_buffer(ht) : NULL;
+    if (!deadline) {
+        settle_buffer(ht);
+    } else if (buffer && lock_buffer_until(buffer, deadline)) {
+        return DB_BUSY;
+    }
+    struct iovec part = {value, value_size};
+    int rc = write_key(ht, key, &part, 1, 0, deadline);
+    if (buffer) {
+        if (rc == 0) delete_key(buffer->pending, key, NULL); // The older buffered write must not land after this one
+        pthread_mutex_unlock(&buffer->lock);
+    }
+    return rc;
+}
+
+// Insert or update a key with a value gathered from several buffers, without concatenating them first
+int db_insertv(Hashtable *ht, const char *key, const struct iovec *iov, int iovcnt) {
+    settle_buffer(ht);
+    return write_key(ht, key, iov, iovcnt, 0, NULL);
+}
+
+// Append bytes to the value of a key, inserting the key if it is missing
+// The value buffer grows geometrically, so a run of appends copies each byte O(1) times
+int db_append(Hashtable *ht, const char *key, const void *bytes, size_t len) {
+    settle_buffer(ht);
+    if (ht->flags & DB_SET) {
+        return -1; // Set tables have no values
+    }
+    struct iovec part = {(void *)bytes, len};
+    return write_key(ht, key, &part, 1, 1, NULL);
+}
+
+// Append bytes to the value of a key before a deadline, see db_try_insert
+int db_try_append(Hashtable *ht, const char *key, const void *bytes, size_t len, const struct timespec *deadline) {
+    if (ht->flags & DB_SET) {
+        return -1; // Set tables have no values
+    }
+    WriteBuffer *buffer = deadline ? thread_buffer(ht) : NULL;
+    if (!deadline) {
+        settle_buffer(ht);
+    } else if (buffer && lock_buffer_until(buffer, deadline)) {
+        return DB_BUSY;
+    }
+    Entry *buffered = buffer ? buffered_write(buffer, key) : NULL;
+    struct iovec parts[2] = {{buffered ? buffered->value : NULL, buffered ? buffered->value_size : 0}, {(void *)bytes, len}};
+    // A buffered value is newer than the table's, so it replaces it with the bytes appended
+    int rc = buffered ? write_key(ht, key, parts, 2, 0, deadline) : write_key(ht, key, &parts[1], 1, 1, deadline);
+    if (buffer) {
+        if (rc == 0 && buffered) delete_key(buffer->pending, key, NULL);
+        pthread_mutex_unlock(&buffer->lock);
+    }
+    return rc;
+}
+
+// Bulk load key-value pairs into a table no other thread is using yet
+// The table is sized once up front and no bucket locks are taken
+int db_bulk_load(Hashtable *ht, const char **keys, void **values, const size_t *value_sizes, size_t count) {
+    settle_buffer(ht);
+    for (size_t i = 0; (ht->log || ht->warm) && i < count; i++) {
+        db_insert(ht, keys[i], values[i], value_sizes[i]); // Log tables append records one by one, warm starts load meanwhile
+    }
+    if (ht->log || ht->warm) {
+        return 0; // Success
+    }
+    size_t needed = (size_t)((ht->count + count) / LOAD_FACTOR_THRESHOLD) + 1;
+    if (needed > ht->size) {
+        resize_to(ht, needed);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        unsigned int key_hash = hash_key(keys[i], ht->seed);
+        struct iovec part = {values[i], value_sizes[i]};
+        if (insert_entry(ht, key_hash % ht->size, key_hash, keys[i], &part, 1, 0) == SIZE_MAX) {
+            resize(ht); // Arena holes used up the references, compact and try again
+            i--;
+        }
+    }
+    return 0; // Success
+}
+
+// Cheap per-thread random number (xorshift32)
+uint32_t thread_random(void) {
+    static _Thread_local uint32_t state = 0;
+    if (state == 0) {
+        state = (uint32_t)mix64((uint64_t)(uintptr_t)&state) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Move a hit entry to the head of its chain now and then, the caller holds the bucket lock
+// Promoting only once in PROMOTE_ODDS hits keeps writes off the read path for hot keys
+void promote_entry(Hashtable *ht, unsigned int index, Entry *entry) {
+    Entry *prev = entry_at(ht, bucket_head(ht, index));
+    if (prev == entry || bucket_tree(ht, index) || thread_random() % PROMOTE_ODDS != 0) {
+        return; // Already first, kept in tree order, or not this time
+    }
+
+    while (entry_at(ht, prev->next) != entry) {
+        prev = entry_at(ht, prev->next);
+    }
+    link_entry(ht, index, NULL, unlink_entry(ht, index, prev, entry), entry);
+}
+
+// Count a lookup hit on an entry, the caller holds the bucket lock
+void count_hit(Entry *entry) {
+    if (entry->hits != ENTRY_HITS_MAX) entry->hits++;
+}
+
+// Lookup a key before an absolute CLOCK_MONOTONIC deadline (see deadline_after), NULL waits as long as it takes
+// Returns 0 with a copy of the value in *value, -1 if the key is missing, or DB_BUSY once the deadline passes
+int db_try_lookup(Hashtable *ht, const char *key, void **value, size_t *value_size, const struct timespec *deadline) {
+    WriteBuffer *buffer = thread_buffer(ht);
+    if (buffer) {
+        if (lock_buffer_until(buffer, deadline)) {
+            return DB_BUSY;
+        }
+        int rc = db_try_lookup(buffer->pending, key, value, value_size, NULL); // The thread's own buffered writes first
+        pthread_mutex_unlock(&buffer->lock);
+        if (rc == 0) return 0;
+    }
+    if (ht->log) {
+        return log_lookup(ht, key, value, value_size, deadline);
+    }
+    unsigned int key_hash, index;
+    if (enter_bucket_until(ht, key, &key_hash, &index, deadline)) {
+        return DB_BUSY;
+    }
+    if (!bucket_may_contain(ht, index, key_hash)) {
+        table_leave(ht);
+        return -1; // Miss rejected without touching the bucket lock
+    }
+    if (lock_bucket_until(ht, index, deadline)) {
+        return DB_BUSY;
+    }
+
+    Entry *entry = find_entry(ht, index, key_hash, key);
+    if (!entry) {
+        unlock_bucket(ht, index);
+        return -1; // Key not found
+    }
+    count_hit(entry);
+    if (ht->flags & DB_MOVE_TO_FRONT) {
+        promote_entry(ht, index, entry);
+    }
+    *value = copy_value(ht, entry, value_size);
+    unlock_bucket(ht, index);
+    return 0; // Success
+}
+
+// Lookup a key
+void *db_lookup(Hashtable *ht, const char *key, size_t *value_size) {
+    void *value;
+    return db_try_lookup(ht, key, &value, value_size, NULL) == 0 ? value : NULL;
+}
+
+// Lookup a key and scatter its value across several buffers in order, without an intermediate copy
+// value_size receives the full value size, buffers past it are left untouched and excess value bytes are dropped
+int db_lookupv(Hashtable *ht, const char *key, const struct iovec *iov, int iovcnt, size_t *value_size) {
+    settle_buffer(ht);
+    if (ht->log) {
+        void *value;
+        int rc = log_lookup(ht, key, &value, value_size, NULL);
+        if (rc == 0) {
+            iov_scatter(iov, iovcnt, value, *value_size);
+            free(value);
+        }
+        return rc;
+    }
+    unsigned int key_hash;
+    unsigned int index = enter_bucket(ht, key, &key_hash);
+    if (!bucket_may_contain(ht, index, key_hash)) {
+        table_leave(ht);
+        return -1; // Key not found
+    }
+    pthread_mutex_lock(bucket_lock(ht, index));
+
+    Entry *entry = find_entry(ht, index, key_hash, key);
+    if (!entry) {
+        unlock_bucket(ht, index);
+        return -1; // Key not found
+    }
+    count_hit(entry);
+    if (ht->flags & DB_MOVE_TO_FRONT) {
+        promote_entry(ht, index, entry);
+    }
+    *value_size = entry_value_size(ht, entry);
+    iov_scatter(iov, iovcnt, *value_size ? entry->value : NULL, *value_size);
+    unlock_bucket(ht, index);
+    return 0; // Success
+}
+
+// Copy len bytes of a key's value starting at offset into buf, without copying the rest of the value
+// Returns -1 if the key is missing or the range runs past the end of the value
+int db_read_range(Hashtable *ht, const char *key, size_t offset, size_t len, void *buf) {
+    settle_buffer(ht);
+    if (ht->log) {
+        return -1; // Not supported on log tables
+    }
+    unsigned int key_hash;
+    unsigned int index = enter_bucket(ht, key, &key_hash);
+    if (!bucket_may_contain(ht, index, key_hash)) {
+        table_leave(ht);
+        return -1; // Key not found
+    }
+    pthread_mutex_lock(bucket_lock(ht, index));
+
+    Entry *entry = find_entry(ht, index, key_hash, key);
+    size_t value_size = entry ? entry_value_size(ht, entry) : 0;
+    if (!entry || offset > value_size || len > value_size - offset) {
+        unlock_bucket(ht, index);
+        return -1; // Key not found or range out of bounds
+    }
+    count_hit(entry);
+    if (ht->flags & DB_MOVE_TO_FRONT) {
+        promote_entry(ht, index, entry);
+    }
+    if (len) memcpy(buf, (char *)entry->value + offset, len);
+    unlock_bucket(ht, index);
+    return 0; // Success
+}
+
+// Overwrite len bytes of a key's value starting at offset, in place
+// The value grows when the range runs past its end; offset itself may be at most the value size
+int db_write_range(Hashtable *ht, const char *key, size_t offset, const void *bytes, size_t len) {
+    settle_buffer(ht);
+    if (ht->flags & (DB_SET | DB_LOG)) {
+        return -1; // Set tables have no values, log tables do not support it
+    }
+
+    unsigned int key_hash;
+    unsigned int index = lock_bucket(ht, key, &key_hash);
+    Entry *entry = find_entry(ht, index, key_hash, key);
+    if (!entry || offset > entry->value_size) {
+        unlock_bucket(ht, index);
+        return -1; // Key not found or the range would leave a gap
+    }
+    if (offset + len > entry->value_size) {
+        reserve_value(entry, offset + len);
+        entry->value_size = offset + len;
+    }
+    if (len) memcpy((char *)entry->value + offset, bytes, len);
+    entry->version = next_version(ht);
+    unlock_bucket(ht, index);
+    notify_key(ht, key);
+    return 0; // Success
+}
+
+// Delete a key before a deadline, see db_try_delete; the caller has dealt with its write buffer
+int delete_key(Hashtable *ht, const char *key, const struct timespec *deadline) {
+    if (ht->log) {
+        return log_delete(ht, key, deadline);
+    }
+    unsigned int key_hash, index;
+    if (enter_bucket_until(ht, key, &key_hash, &index, deadline) || lock_bucket_until(ht, index, deadline)) {
+        return DB_BUSY;
+    }
+
+    BucketTree *tree = bucket_tree(ht, index);
+    Entry *prev = NULL, *entry = NULL;
+    if (tree) {
+        int found;
+        size_t position = tree_search(tree, key_hash, key, &found);
+        if (found) {
+            entry = tree->entries[position];
+            prev = position > 0 ? tree->entries[position - 1] : NULL;
+            tree->count--;
+            memmove(&tree->entries[position], &tree->entries[position + 1], sizeof(Entry *) * (tree->count - position));
+            if (tree->count < UNTREEIFY_THRESHOLD) {
+                atomic_load(&ht->trees)[index] = NULL; // The chain is already linked
+                free(tree);
+            }
+        }
+    } else {
+        entry = entry_at(ht, bucket_head(ht, index));
+        while (entry && !(entry->hash == key_hash && strcmp(entry->key, key) == 0)) {
+            prev = entry;
+            entry = entry_at(ht, entry->next);
+        }
+    }
+
+    if (!entry) {
+        unlock_bucket(ht, index);
+        return -1; // Key not found
+    }
+
+    EntryRef ref = unlink_entry(ht, index, prev, entry);
+    if (!bucket_tree(ht, index)) {
+        retag_bucket(ht, index); // Trees keep a conservative summary so deletes stay O(log n)
+    }
+    free_entry_data(ht, entry);
+    free_entry(ht, ref, entry);
+    ht->count--;
+    unlock_bucket(ht, index);
+    notify_key(ht, key);
+    return 0; // Success
+}
+
+// Delete a key-value pair before an absolute CLOCK_MONOTONIC deadline, NULL waits as long as it takes
+// Returns 0, -1 if the key is missing, or DB_BUSY once the deadline passes
+int db_try_delete(Hashtable *ht, const char *key, const struct timespec *deadline) {
+    WriteBuffer *buffer = deadline ? thread_buffer(ht) : NULL;
+    if (!deadline) {
+        settle_buffer(ht);
+    } else if (buffer && lock_buffer_until(buffer, deadline)) {
+        return DB_BUSY;
+    }
+    int rc = delete_key(ht, key, deadline);
+    if (buffer) {
+        if (rc != DB_BUSY && delete_key(buffer->pending, key, NULL) == 0) {
+            rc = 0; // The key only existed as a buffered write
+        }
+        pthread_mutex_unlock(&buffer->lock);
+    }
+    return rc;
+}
+
+// Delete a key-value pair
+int db_delete(Hashtable *ht, const char *key) {
+    return db_try_delete(ht, key, NULL);
+}
+
+// Current version of a key, 0 if the key is missing
+// Every insert, update, append, range write and delete of the key changes it
+uint64_t db_version(Hashtable *ht, const char *key) {
+    settle_buffer(ht);
+    if (ht->log) {
+        return log_version(ht, key);
+    }
+    unsigned int key_hash;
+    unsigned int index = enter_bucket(ht, key, &key_hash);
+    if (!bucket_may_contain(ht, index, key_hash)) {
+        table_leave(ht);
+        return 0;
+    }
+    pthread_mutex_lock(bucket_lock(ht, index));
+    Entry *entry = find_entry(ht, index, key_hash, key);
+    uint64_t version = entry ? entry->version : 0;
+    unlock_bucket(ht, index);
+    return version;
+}
+
+// Sleep until the version of a key differs from last_version, or timeout_ms passes (negative waits forever)
+// Pass 0 to wait for a missing key to appear. Sleepers share WAIT_STRIPES futex words per table,
+// so writers only pay for a wakeup while someone is waiting
+// Returns 0 with the new version in *version, -1 on timeout with the unchanged version in *version
+int db_wait(Hashtable *ht, const char *key, uint64_t last_version, long timeout_ms, uint64_t *version) {
+    struct timespec deadline, left;
+    if (timeout_ms >= 0) deadline = deadline_after(timeout_ms);
+    atomic_uint *word = &ht->wait_seq[hash_key(key, 0) % WAIT_STRIPES];
+
+    int rc = 0;
+    atomic_fetch_add(&ht->waiting, 1); // Before the version check, so a later change sees us
+    for (;;) {
+        unsigned int observed = atomic_load(word);
+        *version = db_version(ht, key);
+        if (*version != last_version) {
+            break;
+        }
+        if (timeout_ms >= 0 && !time_left(&deadline, &left)) {
+            rc = -1; // Timed out
+            break;
+        }
+        wait_on_word(word, observed, timeout_ms >= 0 ? &left : NULL);
+    }
+    atomic_fetch_sub(&ht->waiting, 1);
+    return rc;
+}
+
+// Nonzero while the calling thread loads a snapshot segment, so its own inserts skip the warm-up check
+int *warming_thread(void) {
+    static _Thread_local int warming = 0;
+    return &warming;
+}
+
+// Load a snapshot segment, or wait for the thread already loading it
+void load_segment(Hashtable *ht, WarmStart *warm, size_t segment) {
+    unsigned int state = SEGMENT_COLD;
+    if (!atomic_compare_exchange_strong(&warm->states[segment], &state, SEGMENT_LOADING)) {
+        while ((state = atomic_load(&warm->states[segment])) != SEGMENT_LOADED) {
+            wait_on_word(&warm->states[segment], state, NULL);
+        }
+        return;
+    }
+
+    size_t size = warm->spans[2 * segment + 1];
+    char *data = malloc(size ? size : 1);
+    if (pread(warm->fd, data, size, (off_t)warm->spans[2 * segment]) != (ssize_t)size) {
+        perror("Failed to read snapshot segment");
+        size = 0;
+    }
+    *warming_thread() = 1;
+    for (size_t at = 0; at + 2 * sizeof(size_t) <= size;) {
+        size_t key_length, value_size;
+        memcpy(&key_length, data + at, sizeof(size_t));
+        const char *key = data + at + sizeof(size_t);
+        memcpy(&value_size, key + key_length, sizeof(size_t));
+        struct iovec part = {(void *)(key + key_length + sizeof(size_t)), value_size};
+        write_key(ht, key, &part, 1, 0, NULL);
+        at += 2 * sizeof(size_t) + key_length + value_size;
+    }
+    *warming_thread() = 0;
+    free(data);
+
+    atomic_store(&warm->states[segment], SEGMENT_LOADED);
+    wake_word(&warm->states[segment]);
+    atomic_fetch_add(&warm->loaded, 1);
+}
+
+// Make sure the snapshot segment of a key is loaded before the key is used
+void warm_key(Hashtable *ht, const char *key) {
+    WarmStart *warm = ht->warm;
+    if (atomic_load(&warm->loaded) == warm->segments || *warming_thread()) {
+        return; // Warm-up done, or this thread is loading the key's segment
+    }
+    size_t segment = hash_key(key, 0) % warm->segments;
+    if (atomic_load(&warm->states[segment]) != SEGMENT_LOADED) {
+        load_segment(ht, warm, segment);
+    }
+}
+
+// Make sure the snapshot segment of a key is loaded before a deadline, NULL loads it as warm_key does
+// A cold segment is left to the loader thread, which takes it next, so the caller never reads the file
+// Returns 0, or DB_BUSY if the segment is still not loaded when the deadline passes
+int warm_key_until(Hashtable *ht, const char *key, const struct timespec *deadline) {
+    WarmStart *warm = ht->warm;
+    if (!deadline || !warm->has_loader) {
+        warm_key(ht, key); // Without a loader thread db_warm_start has already loaded everything
+        return 0;
+    }
+    if (atomic_load(&warm->loaded) == warm->segments || *warming_thread()) {
+        return 0;
+    }
+    size_t segment = hash_key(key, 0) % warm->segments;
+    unsigned int state = atomic_load(&warm->states[segment]);
+    if (state == SEGMENT_COLD) {
+        atomic_store(&warm->wanted, segment + 1); // The latest request wins, an earlier one falls back to file order
+    }
+    struct timespec left;
+    while ((state = atomic_load(&warm->states[segment])) != SEGMENT_LOADED) {
+        if (!time_left(deadline, &left)) return DB_BUSY;
+        wait_on_word(&warm->states[segment], state, &left);
+    }
+    return 0;
 }
 
-// Resize the hashtable
-void resize(Hashtable *ht) {
-    size_t new_size = ht->size * 2;
-    Entry **new_table = calloc(new_size, sizeof(Entry *));
-    pthread_mutex_t *new_locks = malloc(sizeof(pthread_mutex_t) * new_size);
+// Load every segment still cold, for operations on the whole table
+void warm_all(Hashtable *ht) {
+    WarmStart *warm = ht->warm;
+    for (size_t i = 0; warm && atomic_load(&warm->loaded) < warm->segments && i < warm->segments; i++) {
+        load_segment(ht, warm, warm->order[i]);
+    }
+}
 
-    for (size_t i = 0; i < new_size; i++) {
-        pthread_mutex_init(&new_locks[i], NULL);
+// Load the segments of a warm start in file order until all are loaded or the table closes
+void *warm_worker(void *arg) {
+    Hashtable *ht = arg;
+    WarmStart *warm = ht->warm;
+    for (size_t i = 0; i < warm->segments && !atomic_load(&warm->stop);) {
+        size_t wanted = atomic_exchange(&warm->wanted, 0);
+        load_segment(ht, warm, wanted ? wanted - 1 : warm->order[i++]); // Loaded segments return at once
     }
+    return NULL;
+}
 
-    for (size_t i = 0; i < ht->size; i++) {
-        pthread_mutex_lock(&ht->locks[i]);
-        Entry *entry = ht->table[i];
-        while (entry) {
-            unsigned int new_index = hash(entry->key, new_size);
-            Entry *next_entry = entry->next;
+typedef struct PrefaultJob {
+    char *starts[32];    // memory regions of the table: buckets, trees and arena slabs, or the log
+    size_t lengths[32];
+    size_t regions;
+    size_t chunks;       // chunks of all regions together
+    size_t page_size;
+    atomic_size_t next;  // next chunk to claim
+} PrefaultJob;
 
-            entry->next = new_table[new_index];
-            new_table[new_index] = entry;
+// Add a memory region to a prefault job
+void prefault_add(PrefaultJob *job, void *start, size_t length) {
+    if (!start || !length) return;
+    job->starts[job->regions] = start;
+    job->lengths[job->regions++] = length;
+    job->chunks += (length + PREFAULT_CHUNK_BYTES - 1) / PREFAULT_CHUNK_BYTES;
+}
+
+// Fault in the pages of a range for writing, asking the kernel to populate them first where it can
+void prefault_range(char *start, size_t length, size_t page_size) {
+    char *page = (char *)((uintptr_t)start & ~(uintptr_t)(page_size - 1));
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(page, start + length - page, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    for (; page < start + length; page += page_size) {
+        volatile char *byte = page < start ? start : page;
+        *byte = *byte; // A write, so untouched calloc pages get a frame of their own instead of the zero page
+    }
+}
 
-            entry = next_entry;
+// Claim chunks of the job's regions and fault them in until none are left
+void *prefault_worker(void *arg) {
+    PrefaultJob *job = arg;
+    size_t chunk;
+    while ((chunk = atomic_fetch_add(&job->next, 1)) < job->chunks) {
+        size_t region = 0, region_chunks;
+        while (chunk >= (region_chunks = (job->lengths[region] + PREFAULT_CHUNK_BYTES - 1) / PREFAULT_CHUNK_BYTES)) {
+            chunk -= region_chunks;
+            region++;
         }
-        pthread_mutex_unlock(&ht->locks[i]);
+        size_t offset = chunk * PREFAULT_CHUNK_BYTES;
+        size_t length = job->lengths[region] - offset;
+        prefault_range(job->starts[region] + offset, length < PREFAULT_CHUNK_BYTES ? length : PREFAULT_CHUNK_BYTES,
+                       job->page_size);
     }
+    return NULL;
+}
 
-    free(ht->table);
-    free(ht->locks);
+// Fault in the bucket array, bucket trees, entry arena or hybrid log memory of a table on threads helper threads,
+// so the first operations after a load do not pay for first-touch page faults. The table is held exclusively meanwhile
+void db_prefault(Hashtable *ht, unsigned int threads) {
+    settle_buffer(ht);
+    warm_all(ht);
+    table_lock_exclusive(ht);
+    PrefaultJob job;
+    job.regions = 0;
+    job.chunks = 0;
+    job.page_size = (size_t)sysconf(_SC_PAGESIZE);
+    atomic_init(&job.next, 0);
+    if (ht->log) {
+        pthread_mutex_lock(&ht->log->tail_lock); // A writer may be turning a page outside the table, over the same frames
+        prefault_add(&job, ht->log->frames, ht->log->frame_count * LOG_PAGE_SIZE);
+        prefault_add(&job, ht->log->index, ht->size * sizeof(uint64_t));
+    } else if (ht->groups) {
+        prefault_add(&job, ht->groups, stripe_count(ht->size, SPARSE_GROUP_BITS) * sizeof(SparseGroup));
+    } else {
+        prefault_add(&job, ht->table, ht->size * ht->slot_width);
+    }
+    prefault_add(&job, atomic_load(&ht->trees), ht->size * sizeof(BucketTree *));
+#ifdef HASHTABLE_COMPACT_REFS
+    for (size_t i = 0; i < ARENA_SLABS; i++) {
+        // Whole slabs, so the entries inserted after the load find their memory mapped too
+        prefault_add(&job, atomic_load(&ht->slabs[i]), ((size_t)1 << (ARENA_FIRST_SLAB_BITS + i)) * ht->entry_size);
+    }
+#endif
 
-    ht->table = new_table;
-    ht->locks = new_locks;
-    ht->size = new_size;
+    size_t helpers = threads;
+    if (helpers + 1 > job.chunks) helpers = job.chunks ? job.chunks - 1 : 0;
+    pthread_t *workers = malloc(sizeof(pthread_t) * (helpers + 1));
+    size_t started = 0;
+    while (started < helpers && pthread_create(&workers[started], NULL, prefault_worker, &job) == 0) {
+        started++;
+    }
+    prefault_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (ht->log) pthread_mutex_unlock(&ht->log->tail_lock);
+    table_unlock_exclusive(ht);
 }
 
-// Insert or update a key-value pair
-int db_insert(Hashtable *ht, const char *key, void *value, size_t value_size) {
-    if ((double)ht->count / ht->size > LOAD_FACTOR_THRESHOLD) {
-        resize(ht);
+// Order (offset, segment) pairs by offset
+int offset_compare(const void *a, const void *b) {
+    uint64_t x = ((const uint64_t *)a)[0], y = ((const uint64_t *)b)[0];
+    return (x > y) - (x < y);
+}
+
+// Start serving a segmented snapshot (see db_serialize_segmented) before it is loaded
+// Only the segment index is read up front; a background thread loads the segments in file order (hottest first), and an operation
+// on a key whose segment is still cold loads that segment first, so every key reads as if the load had finished
+// Call on a table no other thread is using yet
+int db_warm_start(Hashtable *ht, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open file for reading");
+        return -1;
     }
 
-    unsigned int index = hash(key, ht->size);
-    pthread_mutex_lock(&ht->locks[index]);
+    char magic[8];
+    uint64_t header[2]; // segments, keys
+    if (ht->warm || pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, "HTSEGv1", 8) != 0 ||
+        pread(fd, header, sizeof(header), sizeof(magic)) != sizeof(header) || header[0] == 0) {
+        close(fd);
+        return -1; // Already warming, or not a segmented snapshot
+    }
+    size_t spans_size = 2 * sizeof(uint64_t) * header[0];
+    uint64_t *spans = malloc(spans_size);
+    if (pread(fd, spans, spans_size, sizeof(magic) + sizeof(header)) != (ssize_t)spans_size) {
+        perror("Failed to read snapshot index");
+        free(spans);
+        close(fd);
+        return -1;
+    }
 
-    Entry *entry = ht->table[index];
-    while (entry) {
-        if (strcmp(entry->key, key) == 0) {
-            free(entry->value);
-            entry->value = malloc(value_size);
-            memcpy(entry->value, value, value_size);
-            entry->value_size = value_size;
-            pthread_mutex_unlock(&ht->locks[index]);
-            return 0; // Success
-        }
-        entry = entry->next;
+    size_t needed = (size_t)((ht->count + header[1]) / LOAD_FACTOR_THRESHOLD) + 1;
+    if (needed > ht->size && !ht->log) {
+        resize_to(ht, needed); // Size once for the whole snapshot instead of rehashing while loading
+    }
+    if (ht->flags & DB_PREFAULT) {
+        db_prefault(ht, ht->rehash_threads);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED); // Start reading the segments into the page cache
     }
 
-    Entry *new_entry = malloc(sizeof(Entry));
-    new_entry->key = strdup(key);
-    new_entry->value = malloc(value_size);
-    memcpy(new_entry->value, value, value_size);
-    new_entry->value_size = value_size;
-    new_entry->next = ht->table[index];
-    ht->table[index] = new_entry;
-    ht->count++;
+    WarmStart *warm = malloc(sizeof(WarmStart));
+    warm->fd = fd;
+    warm->segments = header[0];
+    warm->spans = spans;
+    warm->states = malloc(sizeof(atomic_uint) * warm->segments);
+    for (size_t i = 0; i < warm->segments; i++) {
+        atomic_init(&warm->states[i], SEGMENT_COLD);
+    }
 
-    pthread_mutex_unlock(&ht->locks[index]);
+    // Follow the file order, which puts the hottest segments first
+    uint64_t *by_offset = malloc(2 * sizeof(uint64_t) * warm->segments);
+    for (size_t i = 0; i < warm->segments; i++) {
+        by_offset[2 * i] = spans[2 * i];
+        by_offset[2 * i + 1] = i;
+    }
+    qsort(by_offset, warm->segments, 2 * sizeof(uint64_t), offset_compare);
+    warm->order = malloc(sizeof(size_t) * warm->segments);
+    for (size_t i = 0; i < warm->segments; i++) {
+        warm->order[i] = by_offset[2 * i + 1];
+    }
+    free(by_offset);
+    atomic_init(&warm->loaded, 0);
+    atomic_init(&warm->wanted, 0);
+    atomic_init(&warm->stop, 0);
+    ht->warm = warm;
+    warm->has_loader = pthread_create(&warm->loader, NULL, warm_worker, ht) == 0;
+    if (!warm->has_loader) {
+        warm_all(ht); // No thread to load in the background, load now
+    }
     return 0; // Success
 }
 
-// Lookup a key
-void *db_lookup(Hashtable *ht, const char *key, size_t *value_size) {
-    unsigned int index = hash(key, ht->size);
-    pthread_mutex_lock(&ht->locks[index]);
+// Load whatever a warm start has not loaded yet, returns once the whole snapshot is in the table
+void db_warm_finish(Hashtable *ht) {
+    warm_all(ht);
+}
 
-    Entry *entry = ht->table[index];
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            void *value = malloc(entry->value_size);
-            memcpy(value, entry->value, entry->value_size);
-            *value_size = entry->value_size; 
-            pthread_mutex_unlock(&ht->locks[index]);
-            return value; 
-        }
-        entry = entry->next;
-    }
+// Write one db_serialize record: key length, key, value size, value
+void write_record(FILE *file, const char *key, const void *value, size_t value_size) {
+    size_t key_length = strlen(key) + 1;
+    fwrite(&key_length, sizeof(size_t), 1, file);
+    fwrite(key, sizeof(char), key_length, file);
+    fwrite(&value_size, sizeof(size_t), 1, file);
+    if (value_size) fwrite(value, 1, value_size, file);
+}
 
-    pthread_mutex_unlock(&ht->locks[index]);
-    return NULL; 
+// Write an entry as a db_serialize record, DB_SET entries have no value fields to read
+void write_entry(FILE *file, const Hashtable *ht, const Entry *entry) {
+    write_record(file, entry->key, ht->flags & DB_SET ? NULL : entry->value, entry_value_size(ht, entry));
 }
 
-// Delete a key-value pair
-int db_delete(Hashtable *ht, const char *key) {
-    unsigned int index = hash(key, ht->size);
-    pthread_mutex_lock(&ht->locks[index]);
-
-    Entry *entry = ht->table[index];
-    Entry *prev = NULL;
-    while (entry) {
-        if (strcmp(entry->key, key) == 0) {
-            if (prev) {
-                prev->next = entry->next;
-            } else {
-                ht->table[index] = entry->next;
+// Write the live records of a hybrid log table in the db_serialize format, the caller holds the table exclusively
+// Chains run newest first, so the first record of a key decides whether it is written
+void log_serialize(Hashtable *ht, FILE *file) {
+    HybridLog *log = ht->log;
+    Hashtable *seen = create_hashtable_flags((size_t)(ht->count / LOAD_FACTOR_THRESHOLD) + INITIAL_TABLE_SIZE, DB_SET);
+    size_t buffer_size = 256;
+    char *buffer = malloc(buffer_size);
+    int epoch = log_protect(log);
+    for (size_t i = 0; i < ht->size; i++) {
+        LogRecord record;
+        for (uint64_t address = log->index[i]; address >= atomic_load(&log->begin); address = record.prev) {
+            log_read(log, address, &record, sizeof(LogRecord));
+            size_t key_length = record.key_length, value_size = record.value_size;
+            if (log_value_offset(key_length) + value_size > buffer_size) {
+                buffer_size = log_value_offset(key_length) + value_size;
+                buffer = realloc(buffer, buffer_size);
+            }
+            log_read(log, address, buffer, log_value_offset(key_length) + value_size);
+            char *key = buffer + sizeof(LogRecord);
+            unsigned int seen_hash = hash_key(key, seen->seed);
+            if (insert_entry(seen, seen_hash % seen->size, seen_hash, key, NULL, 0, 0) == 0) {
+                continue; // An older version
+            }
+            if (!(record.flags & LOG_TOMBSTONE)) {
+                write_record(file, key, buffer + log_value_offset(key_length), value_size);
             }
-            free(entry->key);
-            free(entry->value);
-            free(entry);
-            ht->count--;
-            pthread_mutex_unlock(&ht->locks[index]);
-            return 0; // Success
         }
-        prev = entry;
-        entry = entry->next;
     }
-
-    pthread_mutex_unlock(&ht->locks[index]);
-    return -1; // Key not found
+    log_unprotect(log, epoch);
+    free(buffer);
+    free_hashtable(seen);
 }
 
 // Serialize hashtable to a file
@@ -223,20 +2888,141 @@ int db_serialize(Hashtable *ht, const char *filename) {
         return -1; 
     }
 
-    for (size_t i = 0; i < ht->size; i++) {
-        pthread_mutex_lock(&ht->locks[i]);
-        Entry *entry = ht->table[i];
-        while (entry) {
-            size_t key_length = strlen(entry->key) + 1; 
-            fwrite(&key_length, sizeof(size_t), 1, file);
-            fwrite(entry->key, sizeof(char), key_length, file);
-            fwrite(&entry->value_size, sizeof(size_t), 1, file);
-            fwrite(entry->value, 1, entry->value_size, file);
-            entry = entry->next;
+    // Writers wait while the snapshot is written, compact builds write it in insertion order
+    settle_buffer(ht);
+    warm_all(ht);
+    table_lock_exclusive(ht);
+    if (ht->log) {
+        log_serialize(ht, file);
+    }
+    EntryCursor cursor = {0, NULL};
+    Entry *entry;
+    while (!ht->log && (entry = next_entry(ht, &cursor))) {
+        write_entry(file, ht, entry);
+    }
+    table_unlock_exclusive(ht);
+
+    fclose(file);
+    return 0; // Success
+}
+
+// Order entries by lookup hits, hottest first
+int hit_compare(const void *a, const void *b) {
+    uint32_t x = (*(Entry *const *)a)->hits, y = (*(Entry *const *)b)->hits;
+    return (x < y) - (x > y);
+}
+
+// Order segments by their summed lookup hits, hottest first
+int segment_heat_compare(const void *a, const void *b) {
+    uint64_t x = ((const uint64_t *)a)[0], y = ((const uint64_t *)b)[0];
+    return (x < y) - (x > y);
+}
+
+// Serialize hashtable in the db_serialize format with the most looked-up entries first,
+// so db_deserialize brings the hot keys back before the rest
+int db_serialize_hot(Hashtable *ht, const char *filename) {
+    if (ht->log) {
+        return -1; // Log records keep no hit counts
+    }
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Failed to open file for writing");
+        return -1;
+    }
+
+    settle_buffer(ht);
+    warm_all(ht);
+    table_lock_exclusive(ht);
+    size_t count = 0;
+    Entry **entries = malloc(sizeof(Entry *) * (atomic_load(&ht->count) + 1));
+    EntryCursor cursor = {0, NULL};
+    while ((entries[count] = next_entry(ht, &cursor))) {
+        count++;
+    }
+    qsort(entries, count, sizeof(Entry *), hit_compare);
+    for (size_t i = 0; i < count; i++) {
+        write_entry(file, ht, entries[i]);
+    }
+    table_unlock_exclusive(ht);
+
+    free(entries);
+    fclose(file);
+    return 0; // Success
+}
+
+// Serialize hashtable to a segmented snapshot that db_warm_start can serve before it is loaded
+// Layout: "HTSEGv1\0", segment count, key count, then an offset and a size per segment, then the segments'
+// db_serialize records. A key belongs to segment hash(key) % segment count; segments are written hottest
+// first by summed lookup hits, and entries within a segment hottest first, so a warm start loads hot keys first
+int db_serialize_segmented(Hashtable *ht, const char *filename) {
+    if (ht->log) {
+        return -1; // Not supported on log tables
+    }
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Failed to open file for writing");
+        return -1;
+    }
+
+    settle_buffer(ht);
+    warm_all(ht);
+    table_lock_exclusive(ht);
+    size_t count = atomic_load(&ht->count);
+    uint64_t header[2] = {count / SNAPSHOT_SEGMENT_KEYS + 1, count};
+    size_t segments = header[0];
+    uint64_t *spans = calloc(segments, 2 * sizeof(uint64_t));  // offset and size of each segment
+    uint64_t *heat = malloc(sizeof(uint64_t) * 2 * segments);  // summed hits and segment, sorted hottest first
+    size_t *start = calloc(segments + 1, sizeof(size_t));
+    Entry **entries = malloc(sizeof(Entry *) * (count + 1));
+    for (size_t i = 0; i < segments; i++) {
+        heat[2 * i] = 0;
+        heat[2 * i + 1] = i;
+    }
+
+    // Count records, bytes and hits per segment, then place the entries segment by segment
+    EntryCursor cursor = {0, NULL};
+    Entry *entry;
+    while ((entry = next_entry(ht, &cursor))) {
+        size_t segment = hash_key(entry->key, 0) % segments;
+        spans[2 * segment + 1] += 2 * sizeof(size_t) + strlen(entry->key) + 1 + entry_value_size(ht, entry);
+        heat[2 * segment] += entry->hits;
+        start[segment + 1]++;
+    }
+    for (size_t i = 0; i < segments; i++) {
+        start[i + 1] += start[i];
+    }
+    size_t *fill = malloc(sizeof(size_t) * segments);
+    memcpy(fill, start, sizeof(size_t) * segments);
+    cursor = (EntryCursor){0, NULL};
+    while ((entry = next_entry(ht, &cursor))) {
+        entries[fill[hash_key(entry->key, 0) % segments]++] = entry;
+    }
+    free(fill);
+
+    qsort(heat, segments, 2 * sizeof(uint64_t), segment_heat_compare);
+    uint64_t offset = 8 + sizeof(header) + 2 * sizeof(uint64_t) * segments;
+    for (size_t i = 0; i < segments; i++) {
+        size_t segment = heat[2 * i + 1];
+        spans[2 * segment] = offset;
+        offset += spans[2 * segment + 1];
+    }
+
+    fwrite("HTSEGv1", 1, 8, file);
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(spans, 2 * sizeof(uint64_t), segments, file);
+    for (size_t i = 0; i < segments; i++) {
+        size_t segment = heat[2 * i + 1];
+        qsort(entries + start[segment], start[segment + 1] - start[segment], sizeof(Entry *), hit_compare);
+        for (size_t j = start[segment]; j < start[segment + 1]; j++) {
+            write_entry(file, ht, entries[j]);
         }
-        pthread_mutex_unlock(&ht->locks[i]);
     }
+    table_unlock_exclusive(ht);
 
+    free(spans);
+    free(heat);
+    free(start);
+    free(entries);
     fclose(file);
     return 0; // Success
 }
@@ -267,6 +3053,9 @@ int db_deserialize(Hashtable *ht, const char *filename) {
     }
 
     fclose(file);
+    if (ht->flags & DB_PREFAULT) {
+        db_prefault(ht, ht->rehash_threads);
+    }
     return 0; // Success
 }
 
@@ -275,9 +3064,652 @@ Hashtable *db_open(size_t initial_size) {
     return create_hashtable(initial_size);
 }
 
+// Open a new hashtable with DB_* flags
+Hashtable *db_open_flags(size_t initial_size, unsigned int flags) {
+    return create_hashtable_flags(initial_size, flags);
+}
+
+// Open a table whose records live in a FASTER-style hybrid log instead of malloc'd entries
+// The newest pages are updated in place, older resident pages copy-on-write, and pages beyond
+// memory_budget (at least two pages) are evicted to the file at path, which is truncated first
+// The index keeps initial_size buckets and does not grow, size it for the expected key count
+Hashtable *db_open_log(size_t initial_size, const char *path, size_t memory_budget) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open log file");
+        return NULL;
+    }
+
+    HybridLog *log = malloc(sizeof(HybridLog));
+    log->fd = fd;
+    log->frame_count = memory_budget >> LOG_PAGE_BITS;
+    if (log->frame_count < 2) log->frame_count = 2;
+    size_t read_only_pages = log->frame_count / LOG_READ_ONLY_SHARE;
+    log->mutable_pages = log->frame_count - (read_only_pages ? read_only_pages : 1);
+    log->frames = calloc(log->frame_count, LOG_PAGE_SIZE);
+    log->index = calloc(initial_size, sizeof(uint64_t));
+    atomic_init(&log->begin, LOG_PAGE_SIZE); // Page 0 stays empty so address 0 can end chains
+    atomic_init(&log->tail, LOG_PAGE_SIZE);
+    atomic_init(&log->read_only, 0);
+    atomic_init(&log->head, 0);
+    log->flushed = 0;
+    pthread_mutex_init(&log->tail_lock, NULL);
+    pthread_mutex_init(&log->compact_lock, NULL);
+    atomic_init(&log->version_index, 0);
+    atomic_init(&log->readers[0], 0);
+    atomic_init(&log->readers[1], 0);
+
+    Hashtable *ht = create_hashtable_flags(initial_size, DB_LOG);
+    ht->log = log;
+    return ht;
+}
+
 // Close the hashtable
 void db_close(Hashtable *ht) {
     free_hashtable(ht);
 }
 
+// Free a table on a detached thread
+void *free_worker(void *arg) {
+    free_hashtable((Hashtable *)arg);
+    return NULL;
+}
+
+// Close the hashtable without waiting for its keys, values and buckets to be freed
+// They are released on a detached thread, or inline if no thread can be started
+void db_close_background(Hashtable *ht) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, free_worker, ht) == 0) {
+        pthread_detach(thread);
+    } else {
+        free_hashtable(ht);
+    }
+}
+
+// Exchange the storage of two tables with the same flags, the caller keeps both to itself
+void swap_storage(Hashtable *a, Hashtable *b) {
+    BucketSlot *table = a->table;
+    a->table = b->table;
+    b->table = table;
+    SparseGroup *groups = a->groups;
+    a->groups = b->groups;
+    b->groups = groups;
+    unsigned int width = a->slot_width;
+    a->slot_width = b->slot_width;
+    b->slot_width = width;
+    pthread_mutex_t *locks = a->locks;
+    a->locks = b->locks;
+    b->locks = locks;
+    size_t size = a->size;
+    a->size = b->size;
+    b->size = size;
+    b->count = atomic_exchange(&a->count, b->count);
+    b->trees = atomic_exchange(&a->trees, b->trees);
+    uint64_t seed = a->seed;
+    a->seed = b->seed;
+    b->seed = seed;
+    size_t reseed_count = a->reseed_count;
+    a->reseed_count = b->reseed_count;
+    b->reseed_count = reseed_count;
+#ifdef HASHTABLE_COMPACT_REFS
+    for (size_t i = 0; i < ARENA_SLABS; i++) {
+        b->slabs[i] = atomic_exchange(&a->slabs[i], b->slabs[i]);
+    }
+    b->arena_next = atomic_exchange(&a->arena_next, b->arena_next);
+#endif
+}
+
+// Empty the table, namespaces included, without waiting for the old contents to be freed
+// The storage is swapped for a fresh one of the size the table was opened with and released on a background thread;
+// namespaces are emptied the same way one by one, so their handles stay valid
+void db_clear(Hashtable *ht) {
+    discard_buffer(ht); // The clear supersedes the calling thread's buffered writes
+    warm_all(ht); // Otherwise the loader would bring cleared keys back
+    Hashtable *old = ht->log ? NULL : create_hashtable_flags(ht->initial_size, ht->flags);
+    if (ht->log) pthread_mutex_lock(&ht->log->compact_lock); // A compaction must not truncate the fresh log
+    pthread_mutex_lock(&ht->ns_lock);
+    table_lock_exclusive(ht);
+    if (ht->log) {
+        log_clear(ht); // Log tables reset in place, in time proportional to the index
+    } else {
+        swap_storage(ht, old);
+    }
+    table_unlock_exclusive(ht);
+    EntryCursor cursor = {0, NULL};
+    Entry *entry;
+    while (ht->namespaces && (entry = next_entry(ht->namespaces, &cursor))) {
+        Hashtable *child;
+        memcpy(&child, entry->value, sizeof(child));
+        db_clear(child);
+    }
+    pthread_mutex_unlock(&ht->ns_lock);
+    if (ht->log) pthread_mutex_unlock(&ht->log->compact_lock);
+    if (atomic_load(&ht->waiting)) {
+        for (size_t i = 0; i < WAIT_STRIPES; i++) {
+            atomic_fetch_add(&ht->wait_seq[i], 1); // Every key changed
+            wake_word(&ht->wait_seq[i]);
+        }
+    }
+    if (old) db_close_background(old);
+}
+
+// Open the namespace of a table with a given name, creating it on first use
+// A namespace is a table of its own for every db_* function, inheriting the parent's flags and rehash threads
+// Keep the handle rather than opening the namespace per operation
+Hashtable *db_ns_open(Hashtable *ht, const char *name) {
+    if (ht->log) {
+        return NULL; // Not supported on log tables
+    }
+    settle_buffer(ht);
+    pthread_mutex_lock(&ht->ns_lock);
+    if (!ht->namespaces) {
+        ht->namespaces = db_open(INITIAL_TABLE_SIZE);
+    }
+
+    Hashtable *child = NULL;
+    size_t value_size;
+    void *value = db_lookup(ht->namespaces, name, &value_size);
+    if (value) {
+        memcpy(&child, value, sizeof(child));
+        free(value);
+    } else {
+        child = db_open_flags(INITIAL_TABLE_SIZE, ht->flags);
+        child->rehash_threads = ht->rehash_threads;
+        db_insert(ht->namespaces, name, &child, sizeof(child));
+    }
+    pthread_mutex_unlock(&ht->ns_lock);
+    return child;
+}
+
+// Drop a namespace: detach it from its table in O(1) and free its contents in the background
+// Handles to the namespace must not be used anymore
+int db_ns_drop(Hashtable *ht, const char *name) {
+    settle_buffer(ht);
+    pthread_mutex_lock(&ht->ns_lock);
+    Hashtable *child = NULL;
+    size_t value_size;
+    void *value = ht->namespaces ? db_lookup(ht->namespaces, name, &value_size) : NULL;
+    if (value) {
+        memcpy(&child, value, sizeof(child));
+        free(value);
+        db_delete(ht->namespaces, name);
+    }
+    pthread_mutex_unlock(&ht->ns_lock);
+
+    if (!child) {
+        return -1; // No such namespace
+    }
+    db_close_background(child);
+    return 0; // Success
+}
+
+// Check whether a key is in the table
+int db_contains(Hashtable *ht, const char *key) {
+    settle_buffer(ht);
+    if (ht->log) {
+        void *value;
+        size_t value_size;
+        if (log_lookup(ht, key, &value, &value_size, NULL) != 0) return 0;
+        free(value);
+        return 1;
+    }
+    unsigned int key_hash;
+    unsigned int index = enter_bucket(ht, key, &key_hash);
+    if (!bucket_may_contain(ht, index, key_hash)) {
+        table_leave(ht);
+        return 0;
+    }
+    pthread_mutex_lock(bucket_lock(ht, index));
+    int found = find_entry(ht, index, key_hash, key) != NULL;
+    unlock_bucket(ht, index);
+    return found;
+}
+
+// Add a key to a set table
+int db_add(Hashtable *ht, const char *key) {
+    return db_insert(ht, key, NULL, 0);
+}
+
+// Remove a key from a set table
+int db_remove(Hashtable *ht, const char *key) {
+    return db_delete(ht, key);
+}
+
+typedef struct SetJob {
+    Hashtable *out;
+    Hashtable *sources[2];
+    int intersect;       // keep keys of the first source found in the second
+    size_t chunks[2];    // chunks of each source to walk
+    atomic_size_t next;  // next chunk to claim, the first source's chunks come first
+} SetJob;
+
+// Whether a table that is held exclusively holds a key of another table's entry
+int set_job_contains(Hashtable *ht, Hashtable *from, const Entry *entry) {
+    unsigned int key_hash = ht->seed == from->seed ? entry->hash : hash_key(entry->key, ht->seed);
+    return find_entry(ht, key_hash % ht->size, key_hash, entry->key) != NULL;
+}
+
+// Claim chunks of the source tables and add their keys to the output until none are left
+void *set_job_worker(void *arg) {
+    SetJob *job = arg;
+    size_t chunk;
+    while ((chunk = atomic_fetch_add(&job->next, 1)) < job->chunks[0] + job->chunks[1]) {
+        int source = chunk >= job->chunks[0];
+        Hashtable *ht = job->sources[source];
+        size_t start = (source ? chunk - job->chunks[0] : chunk) * REHASH_CHUNK;
+        size_t end = start + REHASH_CHUNK < walk_length(ht) ? start + REHASH_CHUNK : walk_length(ht);
+
+        EntryCursor cursor = {start, NULL};
+        Entry *entry;
+        while ((entry = next_entry_in(ht, &cursor, end))) {
+            if (!job->intersect || set_job_contains(job->sources[1], ht, entry)) {
+                db_add(job->out, entry->key);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Build a DB_SET table from the keys of two tables, walking them in chunks on threads helper threads
+// Both tables are held exclusively meanwhile and may be the same table
+Hashtable *set_job_run(Hashtable *a, Hashtable *b, int intersect, unsigned int threads) {
+    if (a->log || b->log) {
+        return NULL; // Not supported on log tables
+    }
+    settle_buffer(a);
+    settle_buffer(b);
+    warm_all(a);
+    warm_all(b);
+    // Lock in address order so two jobs over the same pair cannot deadlock
+    Hashtable *first = a < b ? a : b, *second = a < b ? b : a;
+    table_lock_exclusive(first);
+    if (second != first) table_lock_exclusive(second);
+
+    size_t expected = intersect ? (a->count < b->count ? a->count : b->count) : a->count + b->count;
+    SetJob job;
+    job.out = db_open_flags((size_t)(expected / LOAD_FACTOR_THRESHOLD) + INITIAL_TABLE_SIZE, DB_SET);
+    job.sources[0] = a;
+    job.sources[1] = b;
+    job.intersect = intersect;
+    job.chunks[0] = (walk_length(a) + REHASH_CHUNK - 1) / REHASH_CHUNK;
+    job.chunks[1] = intersect ? 0 : (walk_length(b) + REHASH_CHUNK - 1) / REHASH_CHUNK;
+    atomic_init(&job.next, 0);
+
+    size_t chunks = job.chunks[0] + job.chunks[1];
+    size_t helpers = threads;
+    if (helpers + 1 > chunks) helpers = chunks ? chunks - 1 : 0;
+    pthread_t *workers = malloc(sizeof(pthread_t) * (helpers + 1));
+    size_t started = 0;
+    while (started < helpers && pthread_create(&workers[started], NULL, set_job_worker, &job) == 0) {
+        started++;
+    }
+    set_job_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    if (second != first) table_unlock_exclusive(second);
+    table_unlock_exclusive(first);
+    return job.out;
+}
+
+// Union of the keys of two tables as a new DB_SET table
+Hashtable *db_set_union(Hashtable *a, Hashtable *b, unsigned int threads) {
+    return set_job_run(a, b, 0, threads);
+}
+
+// Intersection of the keys of two tables as a new DB_SET table
+Hashtable *db_set_intersection(Hashtable *a, Hashtable *b, unsigned int threads) {
+    // Walk the smaller table and probe the larger one
+    return a->count <= b->count ? set_job_run(a, b, 1, threads) : set_job_run(b, a, 1, threads);
+}
+
+// Open a left-right table, two instances kept in sync for wait-free readers
+LeftRightHashtable *db_lr_open(size_t initial_size) {
+    LeftRightHashtable *lr = malloc(sizeof(LeftRightHashtable));
+    lr->instances[0] = create_hashtable(initial_size);
+    lr->instances[1] = create_hashtable(initial_size);
+    atomic_init(&lr->left_right, 0);
+    atomic_init(&lr->version_index, 0);
+    atomic_init(&lr->readers[0], 0);
+    atomic_init(&lr->readers[1], 0);
+    pthread_mutex_init(&lr->writer_lock, NULL);
+    return lr;
+}
+
+// Lookup a key without taking any lock
+void *db_lr_lookup(LeftRightHashtable *lr, const char *key, size_t *value_size) {
+    int version = atomic_load(&lr->version_index);
+    atomic_fetch_add(&lr->readers[version], 1);
+
+    Hashtable *ht = lr->instances[atomic_load(&lr->left_right)];
+    void *value = NULL;
+    unsigned int key_hash = hash_key(key, ht->seed);
+    Entry *entry = find_entry(ht, key_hash % ht->size, key_hash, key);
+    if (entry) {
+        value = copy_value(ht, entry, value_size);
+    }
+
+    atomic_fetch_sub(&lr->readers[version], 1);
+    return value;
+}
+
+// Apply a batch of writes to one instance
+int lr_apply_ops(Hashtable *ht, const WriteOp *ops, size_t count) {
+    int rc = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].remove) {
+            if (db_delete(ht, ops[i].key) != 0) rc = -1;
+        } else {
+            db_insert(ht, ops[i].key, ops[i].value, ops[i].value_size);
+        }
+    }
+    return rc;
+}
+
+// Apply a batch of writes, readers see either none or all of it
+int db_lr_apply(LeftRightHashtable *lr, const WriteOp *ops, size_t count) {
+    pthread_mutex_lock(&lr->writer_lock);
+
+    // Write the instance readers are not on, then send readers to it
+    int current = atomic_load(&lr->left_right);
+    int rc = lr_apply_ops(lr->instances[1 - current], ops, count);
+    atomic_store(&lr->left_right, 1 - current);
+
+    // Drain readers that may still be on the old instance
+    synchronize_readers(&lr->version_index, lr->readers);
+
+    lr_apply_ops(lr->instances[current], ops, count);
+
+    pthread_mutex_unlock(&lr->writer_lock);
+    return rc;
+}
+
+// Insert or update a key-value pair
+int db_lr_insert(LeftRightHashtable *lr, const char *key, void *value, size_t value_size) {
+    WriteOp op = { key, value, value_size, 0 };
+    return db_lr_apply(lr, &op, 1);
+}
+
+// Delete a key-value pair
+int db_lr_delete(LeftRightHashtable *lr, const char *key) {
+    WriteOp op = { key, NULL, 0, 1 };
+    return db_lr_apply(lr, &op, 1);
+}
+
+// Close a left-right table, no reader may still be using it
+void db_lr_close(LeftRightHashtable *lr) {
+    free_hashtable(lr->instances[0]);
+    free_hashtable(lr->instances[1]);
+    pthread_mutex_destroy(&lr->writer_lock);
+    free(lr);
+}
+
+// Open an RCU table publishing an initial table, the RCU table takes ownership of it
+RcuHashtable *db_rcu_open(Hashtable *ht) {
+    RcuHashtable *rcu = malloc(sizeof(RcuHashtable));
+    atomic_init(&rcu->current, ht);
+    atomic_init(&rcu->version_index, 0);
+    atomic_init(&rcu->readers[0], 0);
+    atomic_init(&rcu->readers[1], 0);
+    pthread_mutex_init(&rcu->writer_lock, NULL);
+    return rcu;
+}
+
+// Lookup a key in the published table without taking any lock
+void *db_rcu_lookup(RcuHashtable *rcu, const char *key, size_t *value_size) {
+    int version = atomic_load(&rcu->version_index);
+    atomic_fetch_add(&rcu->readers[version], 1);
+
+    Hashtable *ht = atomic_load(&rcu->current);
+    void *value = NULL;
+    unsigned int key_hash = hash_key(key, ht->seed);
+    Entry *entry = find_entry(ht, key_hash % ht->size, key_hash, key);
+    if (entry) {
+        value = copy_value(ht, entry, value_size);
+    }
+
+    atomic_fetch_sub(&rcu->readers[version], 1);
+    return value;
+}
+
+// Atomically publish a fully loaded table and free the old one after a grace period
+void db_rcu_publish(RcuHashtable *rcu, Hashtable *ht) {
+    pthread_mutex_lock(&rcu->writer_lock);
+    Hashtable *old = atomic_exchange(&rcu->current, ht);
+    synchronize_readers(&rcu->version_index, rcu->readers);
+    pthread_mutex_unlock(&rcu->writer_lock);
+
+    free_hashtable(old);
+}
+
+// Close an RCU table and the table it publishes, no reader may still be using it
+void db_rcu_close(RcuHashtable *rcu) {
+    free_hashtable(atomic_load(&rcu->current));
+    pthread_mutex_destroy(&rcu->writer_lock);
+    free(rcu);
+}
+
+// Frozen position of a key hash under a given pilot
+size_t frozen_position(uint64_t key_hash, uint32_t pilot, size_t positions) {
+    return mix64(key_hash ^ mix64(pilot + 1)) % positions;
+}
+
+// Frozen slot of a key hash, positions past the last slot are remapped into the slots no key took
+size_t frozen_slot(const FrozenHashtable *ft, uint64_t key_hash) {
+    size_t position = frozen_position(key_hash, ft->pilots[(key_hash >> 32) % ft->buckets], ft->positions);
+    return position < ft->count ? position : ft->remap[position - ft->count];
+}
+
+// Key of a packed frozen record
+const char *frozen_record_key(const char *record) {
+    return record + 2 * sizeof(size_t);
+}
+
+// Search a pilot for every bucket, largest buckets first (PTHash)
+// Keys go to positions out of slightly more than count, so even the last buckets find a free position quickly
+int frozen_find_pilots(const uint64_t *hashes, size_t count, size_t positions, size_t buckets, uint16_t *pilots) {
+    size_t *bucket_start = calloc(buckets + 1, sizeof(size_t));
+    size_t *bucket_keys = malloc(sizeof(size_t) * count);
+    size_t *order = malloc(sizeof(size_t) * buckets);
+    size_t *size_start = calloc(count + 2, sizeof(size_t));
+    size_t *slots = malloc(sizeof(size_t) * count);
+    unsigned char *taken = calloc(positions, 1);
+    int rc = 0;
+
+    // Group keys by bucket
+    for (size_t i = 0; i < count; i++) {
+        bucket_start[(hashes[i] >> 32) % buckets + 1]++;
+    }
+    for (size_t b = 0; b < buckets; b++) {
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    size_t *fill = malloc(sizeof(size_t) * buckets);
+    memcpy(fill, bucket_start, sizeof(size_t) * buckets);
+    for (size_t i = 0; i < count; i++) {
+        bucket_keys[fill[(hashes[i] >> 32) % buckets]++] = i;
+    }
+    free(fill);
+
+    // Order buckets by size, descending
+    for (size_t b = 0; b < buckets; b++) {
+        size_start[count - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (size_t k = 0; k <= count; k++) {
+        size_start[k + 1] += size_start[k];
+    }
+    for (size_t b = 0; b < buckets; b++) {
+        order[size_start[count - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+    }
+
+    for (size_t o = 0; o < buckets && rc == 0; o++) {
+        size_t b = order[o];
+        size_t first = bucket_start[b], n = bucket_start[b + 1] - first;
+        pilots[b] = 0;
+        if (n == 0) continue;
+
+        uint32_t pilot;
+        for (pilot = 0; pilot < FROZEN_MAX_PILOT; pilot++) {
+            size_t placed = 0;
+            while (placed < n) {
+                size_t slot = frozen_position(hashes[bucket_keys[first + placed]], pilot, positions);
+                if (taken[slot]) break;
+                taken[slot] = 1; // also rejects collisions inside the bucket
+                slots[placed++] = slot;
+            }
+            if (placed == n) break;
+            while (placed > 0) {
+                taken[slots[--placed]] = 0;
+            }
+        }
+        if (pilot == FROZEN_MAX_PILOT) {
+            rc = -1; // No pilot found, caller retries with a new seed
+        } else {
+            pilots[b] = pilot;
+        }
+    }
+
+    free(bucket_start);
+    free(bucket_keys);
+    free(order);
+    free(size_start);
+    free(slots);
+    free(taken);
+    return rc;
+}
+
+// Freeze the hashtable into an immutable, lock-free table
+// Records are packed as: key_length, value_size, key (padded to 8 bytes), value, so a lookup compares the key
+// in the record's first cache line
+FrozenHashtable *db_freeze(Hashtable *ht) {
+    if (ht->log) {
+        return NULL; // Not supported on log tables
+    }
+    settle_buffer(ht);
+    warm_all(ht);
+    size_t capacity = 4096, used = 0, count = 0, max_count = 64;
+    char *records = malloc(capacity);
+    uint64_t *offsets = malloc(sizeof(uint64_t) * max_count);
+
+    // Copy every record out while writers wait
+    table_lock_exclusive(ht);
+    EntryCursor cursor = {0, NULL};
+    Entry *entry;
+    while ((entry = next_entry(ht, &cursor))) {
+        size_t key_length = strlen(entry->key) + 1;
+        size_t value_size = entry_value_size(ht, entry);
+        size_t key_padded = (key_length + 7) & ~(size_t)7;
+        size_t record_size = 2 * sizeof(size_t) + key_padded + ((value_size + 7) & ~(size_t)7);
+        while (used + record_size > capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity);
+        }
+        if (count == max_count) {
+            max_count *= 2;
+            offsets = realloc(offsets, sizeof(uint64_t) * max_count);
+        }
+        char *record = records + used;
+        memcpy(record, &key_length, sizeof(size_t));
+        memcpy(record + sizeof(size_t), &value_size, sizeof(size_t));
+        memcpy(record + 2 * sizeof(size_t), entry->key, key_length);
+        if (value_size) memcpy(record + 2 * sizeof(size_t) + key_padded, entry->value, value_size);
+        offsets[count++] = used;
+        used += record_size;
+    }
+    table_unlock_exclusive(ht);
+
+    size_t buckets = count / FROZEN_BUCKET_KEYS + 1;
+    size_t positions = (size_t)(count / FROZEN_LOAD_FACTOR) + 1;
+    uint64_t *hashes = malloc(sizeof(uint64_t) * (count + 1));
+    uint16_t *pilots = malloc(sizeof(uint16_t) * buckets);
+    uint64_t seed = 0;
+    int rc = -1;
+    for (int attempt = 0; attempt < 16 && rc != 0; attempt++) {
+        seed = mix64((uint64_t)(uintptr_t)ht ^ (uint64_t)attempt);
+        for (size_t i = 0; i < count; i++) {
+            hashes[i] = hash64(frozen_record_key(records + offsets[i]), seed);
+        }
+        rc = frozen_find_pilots(hashes, count, positions, buckets, pilots);
+    }
+    if (rc != 0) {
+        free(records);
+        free(offsets);
+        free(hashes);
+        free(pilots);
+        return NULL; // Could not build a perfect hash
+    }
+
+    // Header, pilots, remap, slot offsets and records share one allocation
+    size_t pilots_size = (sizeof(uint16_t) * buckets + 7) & ~(size_t)7;
+    size_t remap_size = sizeof(uint64_t) * (positions - count);
+    FrozenHashtable *ft = malloc(sizeof(FrozenHashtable) + pilots_size + remap_size + sizeof(uint64_t) * count + used);
+    ft->count = count;
+    ft->positions = positions;
+    ft->buckets = buckets;
+    ft->seed = seed;
+    ft->pilots = (uint16_t *)(ft + 1);
+    ft->remap = (uint64_t *)((char *)ft->pilots + pilots_size);
+    ft->offsets = ft->remap + (positions - count);
+    ft->data = (char *)(ft->offsets + count);
+    memcpy(ft->pilots, pilots, sizeof(uint16_t) * buckets);
+
+    // Send each position past the last slot to a slot no key took, there are exactly as many of both
+    unsigned char *taken = calloc(positions, 1);
+    for (size_t i = 0; i < count; i++) {
+        taken[frozen_position(hashes[i], pilots[(hashes[i] >> 32) % buckets], positions)] = 1;
+    }
+    size_t free_slot = 0;
+    for (size_t position = count; position < positions; position++) {
+        if (!taken[position]) {
+            ft->remap[position - count] = 0; // Only misses land here, the key compare rejects them
+            continue;
+        }
+        while (taken[free_slot]) free_slot++;
+        ft->remap[position - count] = free_slot++;
+    }
+    free(taken);
+    for (size_t i = 0; i < count; i++) {
+        ft->offsets[frozen_slot(ft, hashes[i])] = offsets[i];
+    }
+    memcpy(ft->data, records, used);
+
+    free(records);
+    free(offsets);
+    free(hashes);
+    free(pilots);
+    return ft;
+}
+
+// Lookup a key in a frozen table without copying, the value lives as long as the table
+const void *db_frozen_get(const FrozenHashtable *ft, const char *key, size_t *value_size) {
+    if (ft->count == 0) return NULL;
+
+    const char *record = ft->data + ft->offsets[frozen_slot(ft, hash64(key, ft->seed))];
+    if (strcmp(frozen_record_key(record), key) != 0) {
+        return NULL; // Key was not in the frozen set
+    }
+    size_t key_length;
+    memcpy(&key_length, record, sizeof(size_t));
+    memcpy(value_size, record + sizeof(size_t), sizeof(size_t));
+    return record + 2 * sizeof(size_t) + ((key_length + 7) & ~(size_t)7);
+}
+
+// Lookup a key in a frozen table
+void *db_frozen_lookup(const FrozenHashtable *ft, const char *key, size_t *value_size) {
+    size_t size;
+    const void *stored = db_frozen_get(ft, key, &size);
+    if (!stored) return NULL;
+
+    void *value = malloc(size);
+    memcpy(value, stored, size);
+    *value_size = size;
+    return value;
+}
+
+// Free a frozen table
+void db_frozen_close(FrozenHashtable *ft) {
+    free(ft);
+}
+
 #endif // HASHTABLE_H
@@ -0,0 +1,201 @@
+// Compile-time, perfect hashed read-only hashtable
+// BSD 3-Clause License
+// Copyright (c) Alex Gaetano Padula
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef STATIC_HASHTABLE_HPP
+#define STATIC_HASHTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+// Requires C++17. Uses the same hash and pilot scheme as db_freeze in hashtable.h
+
+namespace hashtable {
+
+constexpr std::size_t STATIC_BUCKET_KEYS = 3;          // average keys per pilot bucket
+constexpr std::size_t STATIC_LOAD_PERCENT = 99;        // keys per hundred pilot positions, the rest are remapped
+constexpr std::uint32_t STATIC_MAX_PILOT = 1u << 16;   // pilot search limit before picking a new seed
+constexpr int STATIC_MAX_SEEDS = 16;
+
+// 64-bit finalizer (splitmix64)
+constexpr std::uint64_t mix64(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Seeded 64-bit hash function
+constexpr std::uint64_t hash64(std::string_view key, std::uint64_t seed) {
+    std::uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+    for (char c : key) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL; // FNV-1a
+    }
+    return mix64(hash);
+}
+
+template <typename V, std::size_t N>
+class StaticHashtable {
+    static_assert(N > 0, "a static hashtable needs at least one key");
+
+public:
+    static constexpr std::size_t buckets = N / STATIC_BUCKET_KEYS + 1;
+    static constexpr std::size_t positions = N * 100 / STATIC_LOAD_PERCENT + 1;
+
+    // Build the table, fails to compile (or throws at runtime) on duplicate keys
+    constexpr explicit StaticHashtable(const std::pair<std::string_view, V> (&items)[N]) {
+        for (int attempt = 0; attempt < STATIC_MAX_SEEDS; attempt++) {
+            seed_ = mix64(static_cast<std::uint64_t>(attempt) + 1);
+            std::uint64_t hashes[N] = {};
+            for (std::size_t i = 0; i < N; i++) {
+                hashes[i] = hash64(items[i].first, seed_);
+            }
+            if (find_pilots(items, hashes)) {
+                for (std::size_t i = 0; i < N; i++) {
+                    Slot &slot = slots_[slot_of(hashes[i])];
+                    slot.key = items[i].first;
+                    slot.value = items[i].second;
+                }
+                return;
+            }
+        }
+        throw std::logic_error("static hashtable: no perfect hash found");
+    }
+
+    // Lookup a key, returns nullptr if the key is not in the table
+    constexpr const V *lookup(std::string_view key) const {
+        const Slot &slot = slots_[slot_of(hash64(key, seed_))];
+        return slot.key == key ? &slot.value : nullptr;
+    }
+
+    constexpr bool contains(std::string_view key) const { return lookup(key) != nullptr; }
+
+    constexpr std::size_t size() const { return N; }
+
+private:
+    struct Slot {
+        std::string_view key;
+        V value{};
+    };
+
+    static constexpr std::size_t bucket_of(std::uint64_t key_hash) { return (key_hash >> 32) % buckets; }
+
+    static constexpr std::size_t position_of(std::uint64_t key_hash, std::uint32_t pilot) {
+        return mix64(key_hash ^ mix64(static_cast<std::uint64_t>(pilot) + 1)) % positions;
+    }
+
+    // Slot of a key hash, positions past the last slot are remapped into the slots no key took
+    constexpr std::size_t slot_of(std::uint64_t key_hash) const {
+        std::size_t position = position_of(key_hash, pilots_[bucket_of(key_hash)]);
+        return position < N ? position : remap_[position - N];
+    }
+
+    // Search a pilot for every bucket, largest buckets first (PTHash)
+    // Throws on duplicate keys, which no pilot can separate
+    constexpr bool find_pilots(const std::pair<std::string_view, V> (&items)[N], const std::uint64_t (&hashes)[N]) {
+        // Group keys by bucket
+        std::size_t bucket_start[buckets + 1] = {};
+        std::size_t bucket_keys[N] = {};
+        for (std::size_t i = 0; i < N; i++) {
+            bucket_start[bucket_of(hashes[i]) + 1]++;
+        }
+        std::size_t max_size = 0;
+        for (std::size_t b = 0; b < buckets; b++) {
+            if (bucket_start[b + 1] > max_size) max_size = bucket_start[b + 1];
+            bucket_start[b + 1] += bucket_start[b];
+        }
+        std::size_t fill[buckets] = {};
+        for (std::size_t b = 0; b < buckets; b++) {
+            fill[b] = bucket_start[b];
+        }
+        for (std::size_t i = 0; i < N; i++) {
+            std::size_t b = bucket_of(hashes[i]);
+            for (std::size_t j = bucket_start[b]; j < fill[b]; j++) {
+                if (hashes[bucket_keys[j]] == hashes[i] && items[bucket_keys[j]].first == items[i].first) {
+                    throw std::logic_error("static hashtable: duplicate key");
+                }
+            }
+            bucket_keys[fill[b]++] = i;
+        }
+
+        bool taken[positions] = {};
+        std::size_t slots[N] = {};
+        for (std::size_t size = max_size; size > 0; size--) {
+            for (std::size_t b = 0; b < buckets; b++) {
+                std::size_t first = bucket_start[b];
+                if (bucket_start[b + 1] - first != size) continue;
+
+                std::uint32_t pilot = 0;
+                for (; pilot < STATIC_MAX_PILOT; pilot++) {
+                    std::size_t placed = 0;
+                    while (placed < size) {
+                        std::size_t position = position_of(hashes[bucket_keys[first + placed]], pilot);
+                        if (taken[position]) break; // also rejects collisions inside the bucket
+                        taken[position] = true;
+                        slots[placed++] = position;
+                    }
+                    if (placed == size) break;
+                    while (placed > 0) {
+                        taken[slots[--placed]] = false;
+                    }
+                }
+                if (pilot == STATIC_MAX_PILOT) return false;
+                pilots_[b] = pilot;
+            }
+        }
+
+        // Send each position past the last slot to a slot no key took
+        std::size_t free_slot = 0;
+        for (std::size_t position = N; position < positions; position++) {
+            if (!taken[position]) continue;
+            while (taken[free_slot]) free_slot++;
+            remap_[position - N] = free_slot++;
+        }
+        return true;
+    }
+
+    std::uint64_t seed_ = 0;
+    std::uint32_t pilots_[buckets] = {};
+    std::size_t remap_[positions - N] = {};
+    Slot slots_[N] = {};
+};
+
+// Build a static hashtable from a literal key/value list
+template <typename V, std::size_t N>
+constexpr StaticHashtable<V, N> make_static_hashtable(const std::pair<std::string_view, V> (&items)[N]) {
+    return StaticHashtable<V, N>(items);
+}
+
+} // namespace hashtable
+
+#endif // STATIC_HASHTABLE_HPP
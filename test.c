@@ -0,0 +1,868 @@
+#include "hashtable.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Frozen tables find every key and reject keys they do not hold
+void test_frozen(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    int one = 1;
+    db_insert(ht, "only", &one, sizeof(one));
+    FrozenHashtable *ft = db_freeze(ht);
+    size_t size;
+    const int *stored = db_frozen_get(ft, "only", &size);
+    assert(stored && *stored == 1 && size == sizeof(int));
+    char key[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "missing%d", i);
+        assert(!db_frozen_get(ft, key, &size));
+    }
+    db_frozen_close(ft);
+
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    ft = db_freeze(ht);
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        int *value = db_frozen_lookup(ft, key, &size);
+        assert(value && *value == i);
+        free(value);
+        snprintf(key, sizeof(key), "missing%d", i);
+        assert(!db_frozen_get(ft, key, &size));
+    }
+    db_frozen_close(ft);
+    db_close(ht);
+
+    ht = db_open(INITIAL_TABLE_SIZE);
+    ft = db_freeze(ht);
+    assert(!db_frozen_get(ft, "missing", &size));
+    db_frozen_close(ft);
+    db_close(ht);
+}
+
+void *left_right_reader(void *arg) {
+    LeftRightHashtable *lr = arg;
+    size_t size;
+    for (int i = 0; i < 20000; i++) {
+        int *a = db_lr_lookup(lr, "a", &size), *b = db_lr_lookup(lr, "b", &size);
+        assert(a && b && *a <= *b); // b is written after a in each batch, and batches are seen whole
+        free(a);
+        free(b);
+    }
+    return NULL;
+}
+
+// Left-right readers see whole batches while writers apply them
+void test_left_right(void) {
+    LeftRightHashtable *lr = db_lr_open(INITIAL_TABLE_SIZE);
+    int zero = 0;
+    WriteOp init[2] = {{"a", &zero, sizeof(zero), 0}, {"b", &zero, sizeof(zero), 0}};
+    assert(db_lr_apply(lr, init, 2) == 0);
+    pthread_t readers[2];
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&readers[i], NULL, left_right_reader, lr);
+    }
+    for (int i = 1; i <= 2000; i++) {
+        WriteOp batch[2] = {{"b", &i, sizeof(i), 0}, {"a", &i, sizeof(i), 0}};
+        assert(db_lr_apply(lr, batch, 2) == 0);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    size_t size;
+    int *value = db_lr_lookup(lr, "a", &size);
+    assert(value && *value == 2000);
+    free(value);
+    assert(db_lr_delete(lr, "a") == 0);
+    assert(!db_lr_lookup(lr, "a", &size));
+    assert(db_lr_insert(lr, "c", &zero, sizeof(zero)) == 0);
+    value = db_lr_lookup(lr, "c", &size);
+    assert(value && *value == 0);
+    free(value);
+    db_lr_close(lr);
+}
+
+void *rcu_reader(void *arg) {
+    RcuHashtable *rcu = arg;
+    size_t size;
+    int last = 0;
+    char key[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i % 100);
+        int *value = db_rcu_lookup(rcu, key, &size);
+        assert(value && *value >= last); // Every published table is complete, and they only move forward
+        last = *value;
+        free(value);
+    }
+    return NULL;
+}
+
+// RCU readers always see a whole published table while tables are swapped under them
+void test_rcu(void) {
+    const char *keys[100];
+    void *values[100];
+    size_t sizes[100];
+    char names[100][32];
+    int generation = 0;
+    for (int i = 0; i < 100; i++) {
+        snprintf(names[i], sizeof(names[i]), "key%d", i);
+        keys[i] = names[i];
+        values[i] = &generation;
+        sizes[i] = sizeof(generation);
+    }
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    assert(db_bulk_load(ht, keys, values, sizes, 100) == 0);
+    RcuHashtable *rcu = db_rcu_open(ht);
+    pthread_t readers[2];
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&readers[i], NULL, rcu_reader, rcu);
+    }
+    for (generation = 1; generation <= 200; generation++) {
+        ht = db_open(INITIAL_TABLE_SIZE);
+        assert(db_bulk_load(ht, keys, values, sizes, 100) == 0);
+        db_rcu_publish(rcu, ht);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    size_t size;
+    int *value = db_rcu_lookup(rcu, "key99", &size);
+    assert(value && *value == 200);
+    free(value);
+    assert(!db_rcu_lookup(rcu, "missing", &size));
+    db_rcu_close(rcu);
+}
+
+void *rehash_writer(void *arg) {
+    Hashtable *ht = ((void **)arg)[0];
+    long first = (long)((void **)arg)[1];
+    char key[32];
+    for (int i = (int)first; i < 100000; i += 4) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    return NULL;
+}
+
+// Writers keep going while the table grows, with helper threads moving the buckets
+void test_parallel_rehash(void) {
+    Hashtable *ht = db_open(8);
+    db_set_rehash_threads(ht, 3);
+    pthread_t writers[4];
+    void *args[4][2];
+    for (long i = 0; i < 4; i++) {
+        args[i][0] = ht;
+        args[i][1] = (void *)i;
+        pthread_create(&writers[i], NULL, rehash_writer, args[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    assert(atomic_load(&ht->count) == 100000 && ht->size > 100000);
+    char key[32];
+    size_t size;
+    for (int i = 0; i < 100000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        int *value = db_lookup(ht, key, &size);
+        assert(value && *value == i);
+        free(value);
+    }
+    db_close(ht);
+}
+
+// Fill keys with count names that all land in bucket 0 of a table of size buckets
+void colliding_keys(char (*keys)[32], int count, size_t size) {
+    for (int i = 0, found = 0; found < count; i++) {
+        snprintf(keys[found], 32, "collide%d", i);
+        if (hash_key(keys[found], 0) % size == 0) found++;
+    }
+}
+
+// A long chain turns into a sorted tree and back, and its keys stay reachable
+void test_trees(void) {
+    char keys[12][32];
+    colliding_keys(keys, 12, 1024);
+    Hashtable *ht = db_open(1024);
+    for (int i = 0; i < 12; i++) {
+        db_insert(ht, keys[i], &i, sizeof(i));
+    }
+    assert(ht->seed == 0 && bucket_tree(ht, 0));
+    size_t size;
+    for (int i = 0; i < 12; i++) {
+        int *value = db_lookup(ht, keys[i], &size);
+        assert(value && *value == i);
+        free(value);
+    }
+    for (int i = 0; i < 8; i++) {
+        assert(db_delete(ht, keys[i]) == 0);
+    }
+    assert(!bucket_tree(ht, 0));
+    assert(!db_lookup(ht, keys[0], &size) && db_contains(ht, keys[11]));
+    db_close(ht);
+}
+
+// A pathological chain reseeds the table, spreading the keys out again
+void test_reseed(void) {
+    char keys[40][32];
+    colliding_keys(keys, 40, 1024);
+    Hashtable *ht = db_open(1024);
+    for (int i = 0; i < 40; i++) {
+        db_insert(ht, keys[i], &i, sizeof(i));
+    }
+    assert(ht->seed != 0 && ht->size == 1024);
+    size_t size;
+    for (int i = 0; i < 40; i++) {
+        int *value = db_lookup(ht, keys[i], &size);
+        assert(value && *value == i);
+        free(value);
+    }
+    db_close(ht);
+}
+
+// Lookup hits move their entry to the head of its chain on DB_MOVE_TO_FRONT tables only
+void test_move_to_front(void) {
+    char keys[5][32];
+    colliding_keys(keys, 5, 1024);
+    for (int move = 0; move < 2; move++) {
+        Hashtable *ht = db_open_flags(1024, move ? DB_MOVE_TO_FRONT : 0);
+        for (int i = 0; i < 5; i++) {
+            db_insert(ht, keys[i], &i, sizeof(i));
+        }
+        const char *head = entry_at(ht, bucket_head(ht, 0))->key;
+        const char *hot = strcmp(head, keys[0]) == 0 ? keys[4] : keys[0];
+        size_t size;
+        for (int i = 0; i < 200; i++) {
+            int *value = db_lookup(ht, hot, &size);
+            assert(value);
+            free(value);
+        }
+        assert(strcmp(entry_at(ht, bucket_head(ht, 0))->key, move ? hot : head) == 0);
+        db_close(ht);
+    }
+}
+
+// Entries stay small, and values grown in place keep their bytes
+void test_entry_size(void) {
+#ifdef HASHTABLE_COMPACT_REFS
+    assert(sizeof(Entry) == 40 && offsetof(Entry, value) == 24);
+#else
+    assert(sizeof(Entry) == 48 && offsetof(Entry, value) == 32);
+#endif
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    for (int i = 0; i < 1000; i++) {
+        db_append(ht, "key", "abcdefg", 7);
+    }
+    size_t size;
+    char *value = db_lookup(ht, "key", &size);
+    assert(value && size == 7000 && memcmp(value + 6993, "abcdefg", 7) == 0);
+    free(value);
+    db_insert(ht, "key", "x", 1);
+    db_append(ht, "key", "yz", 2);
+    assert(db_write_range(ht, "key", 2, "0123456789", 10) == 0);
+    value = db_lookup(ht, "key", &size);
+    assert(value && size == 12 && memcmp(value, "xy0123456789", 12) == 0);
+    free(value);
+    db_close(ht);
+}
+
+// Tagged buckets answer most misses from the bucket array alone, and never turn away a present key
+void test_tagged_buckets(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    int rejected = 0;
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        unsigned int key_hash = hash_key(key, ht->seed);
+        assert(bucket_may_contain(ht, key_hash % ht->size, key_hash) && db_contains(ht, key));
+        snprintf(key, sizeof(key), "missing%d", i);
+        key_hash = hash_key(key, ht->seed);
+        rejected += !bucket_may_contain(ht, key_hash % ht->size, key_hash);
+        assert(!db_contains(ht, key));
+    }
+#ifdef HASHTABLE_TAGGED_BUCKETS
+    assert(rejected > 500);
+#endif
+    db_close(ht);
+}
+
+// Snapshots round-trip, and compact builds write keys in insertion order with deleted keys skipped
+void test_insertion_order(void) {
+    Hashtable *ht = db_open(8);
+    char key[32];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+        if (i % 3 == 0) {
+            assert(db_delete(ht, key) == 0); // Holes, compacted away by the rehashes that follow
+        }
+    }
+    assert(db_serialize(ht, "test_order.bin") == 0);
+    db_close(ht);
+
+    FILE *file = fopen("test_order.bin", "rb");
+    size_t key_length, value_size, records = 0;
+    int value;
+#ifdef HASHTABLE_COMPACT_REFS
+    int last = -1;
+#endif
+    while (fread(&key_length, sizeof(size_t), 1, file) == 1) {
+        assert(key_length < sizeof(key) && fread(key, 1, key_length, file) == key_length);
+        assert(fread(&value_size, sizeof(size_t), 1, file) == 1 && value_size == sizeof(int));
+        assert(fread(&value, sizeof(int), 1, file) == 1 && value % 3 != 0);
+#ifdef HASHTABLE_COMPACT_REFS
+        assert(value > last);
+        last = value;
+#endif
+        records++;
+    }
+    fclose(file);
+    assert(records == 2000 - 667);
+
+    ht = db_open(INITIAL_TABLE_SIZE);
+    assert(db_deserialize(ht, "test_order.bin") == 0);
+    assert(atomic_load(&ht->count) == records && db_contains(ht, "key1999") && !db_contains(ht, "key0"));
+    db_close(ht);
+    remove("test_order.bin");
+}
+
+void *sparse_writer(void *arg) {
+    Hashtable *ht = ((void **)arg)[0];
+    long first = (long)((void **)arg)[1];
+    char key[32];
+    for (int i = (int)first; i < 20000; i += 4) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+        if (i % 2) db_delete(ht, key);
+    }
+    return NULL;
+}
+
+// Sparse tables keep their buckets in bitmap groups and behave like any other table under concurrent writers
+void test_sparse(void) {
+    Hashtable *ht = db_open_flags(8, DB_SPARSE);
+    assert(!ht->table && ht->groups);
+    pthread_t writers[4];
+    void *args[4][2];
+    for (long i = 0; i < 4; i++) {
+        args[i][0] = ht;
+        args[i][1] = (void *)i;
+        pthread_create(&writers[i], NULL, sparse_writer, args[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    assert(atomic_load(&ht->count) == 10000);
+    char key[32];
+    size_t size;
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        int *value = db_lookup(ht, key, &size);
+        assert(i % 2 ? !value : value && *value == i);
+        free(value);
+    }
+    db_close(ht);
+}
+
+// Set tables hold keys only, and union and intersection combine any two tables
+void test_sets(void) {
+    Hashtable *a = db_open_flags(INITIAL_TABLE_SIZE, DB_SET), *b = db_open(INITIAL_TABLE_SIZE);
+    assert(a->entry_size == offsetof(Entry, value));
+    char key[32];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        if (i % 2 == 0) db_add(a, key);
+        if (i % 3 == 0) db_insert(b, key, &i, sizeof(i));
+    }
+    size_t size = 1;
+    void *member = db_lookup(a, "key0", &size);
+    assert(member && size == 0);
+    free(member);
+    assert(db_append(a, "key0", "x", 1) == -1);
+
+    Hashtable *both = db_set_intersection(a, b, 2), *either = db_set_union(a, b, 2);
+    assert(atomic_load(&both->count) == 500 && atomic_load(&either->count) == 2000);
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        assert(db_contains(both, key) == (i % 6 == 0));
+        assert(db_contains(either, key) == (i % 2 == 0 || i % 3 == 0));
+    }
+    assert(db_remove(a, "key0") == 0 && !db_contains(a, "key0"));
+    db_close(both);
+    db_close(either);
+    db_close(a);
+    db_close(b);
+}
+
+void *append_writer(void *arg) {
+    Hashtable *ht = arg;
+    for (int i = 0; i < 1000; i++) {
+        db_append(ht, "log", "0123456789", 10);
+    }
+    return NULL;
+}
+
+// Appends create missing keys and land whole, each under one bucket lock
+void test_append(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    assert(db_append(ht, "new", "abc", 3) == 0);
+    size_t size;
+    char *value = db_lookup(ht, "new", &size);
+    assert(value && size == 3 && memcmp(value, "abc", 3) == 0);
+    free(value);
+
+    pthread_t writers[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&writers[i], NULL, append_writer, ht);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    value = db_lookup(ht, "log", &size);
+    assert(value && size == 40000);
+    for (size_t at = 0; at < size; at += 10) {
+        assert(memcmp(value + at, "0123456789", 10) == 0);
+    }
+    free(value);
+    db_close(ht);
+}
+
+// Range reads and writes touch part of a value and refuse ranges that leave gaps or run past the end
+void test_ranges(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    db_insert(ht, "key", "0123456789", 10);
+    char buf[16];
+    assert(db_read_range(ht, "key", 2, 3, buf) == 0 && memcmp(buf, "234", 3) == 0);
+    assert(db_read_range(ht, "key", 8, 3, buf) == -1);
+    assert(db_read_range(ht, "missing", 0, 1, buf) == -1);
+    assert(db_write_range(ht, "key", 4, "ab", 2) == 0);
+    assert(db_write_range(ht, "key", 9, "XYZ", 3) == 0); // Grows the value
+    assert(db_write_range(ht, "key", 13, "!", 1) == -1);  // Would leave a gap
+    assert(db_write_range(ht, "missing", 0, "!", 1) == -1);
+    size_t size;
+    char *value = db_lookup(ht, "key", &size);
+    assert(value && size == 12 && memcmp(value, "0123ab678XYZ", 12) == 0);
+    free(value);
+    uint64_t version = db_version(ht, "key");
+    assert(db_write_range(ht, "key", 0, "-", 1) == 0 && db_version(ht, "key") != version);
+    db_close(ht);
+}
+
+// Scatter/gather stores several buffers as one value and spreads a value back over several buffers
+void test_scatter_gather(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    struct iovec parts[3] = {{"head", 4}, {"", 0}, {"-tail", 5}};
+    assert(db_insertv(ht, "key", parts, 3) == 0);
+    size_t size;
+    char *value = db_lookup(ht, "key", &size);
+    assert(value && size == 9 && memcmp(value, "head-tail", 9) == 0);
+    free(value);
+
+    char first[3], second[3] = {'?', '?', '?'};
+    struct iovec buffers[2] = {{first, 3}, {second, 2}};
+    assert(db_lookupv(ht, "key", buffers, 2, &size) == 0);
+    assert(size == 9 && memcmp(first, "hea", 3) == 0 && memcmp(second, "d-?", 3) == 0);
+    assert(db_lookupv(ht, "missing", buffers, 2, &size) == -1);
+    db_close(ht);
+}
+
+// Namespaces are separate tables under one parent, opened once and dropped in O(1)
+void test_namespaces(void) {
+    Hashtable *ht = db_open_flags(INITIAL_TABLE_SIZE, DB_SET);
+    Hashtable *users = db_ns_open(ht, "users"), *groups = db_ns_open(ht, "groups");
+    assert(users && groups && users != groups && db_ns_open(ht, "users") == users);
+    assert(users->flags & DB_SET);
+    db_add(users, "alice");
+    db_add(groups, "admins");
+    assert(db_contains(users, "alice") && !db_contains(groups, "alice") && !db_contains(ht, "alice"));
+    assert(db_ns_drop(ht, "users") == 0 && db_ns_drop(ht, "missing") == -1);
+    Hashtable *reopened = db_ns_open(ht, "users");
+    assert(!db_contains(reopened, "alice") && db_contains(groups, "admins"));
+    db_close(ht);
+
+    Hashtable *log = db_open_log(INITIAL_TABLE_SIZE, "test_namespaces.log", 1 << 22);
+    assert(!db_ns_open(log, "users"));
+    db_close(log);
+    remove("test_namespaces.log");
+}
+
+// Clearing empties a table in place and keeps the size it was opened with
+void test_clear(void) {
+    Hashtable *ht = db_open(1 << 16);
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    db_clear(ht);
+    assert(atomic_load(&ht->count) == 0 && ht->size == 1 << 16);
+    size_t size;
+    assert(!db_lookup(ht, "key1", &size));
+    int one = 1;
+    db_insert(ht, "key1", &one, sizeof(one));
+    assert(db_contains(ht, "key1"));
+    db_close_background(ht);
+
+    // Namespaces are emptied in place, so their handles stay usable
+    ht = db_open(INITIAL_TABLE_SIZE);
+    Hashtable *ns = db_ns_open(ht, "ns");
+    db_insert(ns, "key", &one, sizeof(one));
+    db_insert(ht, "key", &one, sizeof(one));
+    db_clear(ht);
+    assert(!db_contains(ns, "key") && !db_contains(ht, "key"));
+    db_insert(ns, "after", &one, sizeof(one));
+    assert(db_ns_open(ht, "ns") == ns && db_contains(ns, "after"));
+    assert(db_ns_drop(ht, "ns") == 0 && db_ns_drop(ht, "ns") == -1);
+    db_close(ht);
+}
+
+void *wait_writer(void *arg) {
+    Hashtable *ht = arg;
+    usleep(20000);
+    int one = 1;
+    db_insert(ht, "key", &one, sizeof(one));
+    return NULL;
+}
+
+// db_wait sleeps until a key changes, or times out with the version unchanged
+void test_wait(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    uint64_t version;
+    assert(db_version(ht, "key") == 0);
+    assert(db_wait(ht, "key", 0, 10, &version) == -1 && version == 0);
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, wait_writer, ht);
+    assert(db_wait(ht, "key", 0, 5000, &version) == 0 && version != 0);
+    pthread_join(writer, NULL);
+    assert(version == db_version(ht, "key"));
+
+    uint64_t seen = version;
+    pthread_create(&writer, NULL, wait_writer, ht);
+    assert(db_wait(ht, "key", seen, -1, &version) == 0 && version > seen);
+    pthread_join(writer, NULL);
+    assert(db_wait(ht, "key", 0, 0, &version) == 0); // Already differs, returns at once
+    db_delete(ht, "key");
+    assert(db_version(ht, "key") == 0);
+    db_close(ht);
+}
+
+// Deadline-bound calls give up with DB_BUSY on a held bucket or table, and behave as usual otherwise
+void test_deadlines(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    int one = 1;
+    struct timespec deadline = deadline_after(100);
+    assert(db_try_insert(ht, "key", &one, sizeof(one), &deadline) == 0);
+    void *value;
+    size_t size;
+    assert(db_try_lookup(ht, "key", &value, &size, &deadline) == 0 && *(int *)value == 1);
+    free(value);
+    assert(db_try_lookup(ht, "missing", &value, &size, &deadline) == -1);
+
+    // The bucket lock is not recursive, so this thread's own hold makes every try fail
+    unsigned int key_hash;
+    unsigned int index = lock_bucket(ht, "key", &key_hash);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = deadline_after(20);
+    assert(db_try_insert(ht, "key", &one, sizeof(one), &deadline) == DB_BUSY);
+    assert(db_try_append(ht, "key", "x", 1, &deadline) == DB_BUSY);
+    assert(db_try_delete(ht, "key", &deadline) == DB_BUSY);
+    assert(db_try_lookup(ht, "key", &value, &size, &deadline) == DB_BUSY);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(end.tv_sec - start.tv_sec < 2);
+    unlock_bucket(ht, index);
+
+    table_lock_exclusive(ht);
+    deadline = deadline_after(10);
+    assert(db_try_lookup(ht, "key", &value, &size, &deadline) == DB_BUSY);
+    table_unlock_exclusive(ht);
+    assert(db_try_delete(ht, "key", NULL) == 0 && !db_contains(ht, "key"));
+    db_close(ht);
+}
+
+// Check the values of a log table filled by test_log, every fifth key deleted
+void check_log_values(Hashtable *ht) {
+    char key[32];
+    size_t size;
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        char *value = db_lookup(ht, key, &size);
+        assert(i % 5 == 0 ? !value : value && size == 500 && atoi(value) == i);
+        free(value);
+    }
+}
+
+void *log_waiter(void *arg) {
+    uint64_t version;
+    assert(db_wait(arg, "flag", 0, 5000, &version) == 0 && version != 0);
+    return NULL;
+}
+
+// Log tables evict old pages to their file and read them back, compact, clear and wait like other tables
+void test_log(void) {
+    Hashtable *ht = db_open_log(4096, "test_log.log", 2 << 20);
+    char key[32], value[500];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        memset(value, 'x', sizeof(value));
+        snprintf(value, sizeof(value), "%d", i);
+        db_insert(ht, key, value, sizeof(value));
+    }
+    for (int i = 0; i < 3000; i += 5) {
+        snprintf(key, sizeof(key), "key%d", i);
+        assert(db_delete(ht, key) == 0);
+    }
+    assert(atomic_load(&ht->log->head) >= LOG_PAGE_SIZE); // The first pages only live in the file now
+    check_log_values(ht);
+
+    // Compaction copies the live records forward and drops the old pages
+    assert(db_log_compact(ht, 100) > 0);
+    assert(atomic_load(&ht->log->begin) > LOG_PAGE_SIZE);
+    check_log_values(ht);
+    assert(atomic_load(&ht->count) == 2400);
+
+    pthread_t waiter;
+    pthread_create(&waiter, NULL, log_waiter, ht);
+    usleep(20000);
+    int one = 1;
+    db_insert(ht, "flag", &one, sizeof(one));
+    pthread_join(waiter, NULL);
+    uint64_t version = db_version(ht, "flag"), seen;
+    assert(db_wait(ht, "flag", version, 10, &seen) == -1 && seen == version);
+
+    db_clear(ht);
+    size_t size;
+    assert(atomic_load(&ht->count) == 0 && !db_lookup(ht, "key1", &size) && db_version(ht, "flag") == 0);
+    db_insert(ht, "key1", &one, sizeof(one));
+    assert(db_contains(ht, "key1"));
+    db_close(ht);
+    remove("test_log.log");
+}
+
+// Write-behind buffers writes per thread but keeps the thread's own operations in order
+void test_write_behind(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    assert(db_write_behind(ht, 1000, 0) == 0);
+    assert(db_write_behind(ht, 1000, 0) == -1);
+    int one = 1, two = 2;
+    size_t size;
+    db_insert(ht, "key", &one, sizeof(one));
+    assert(atomic_load(&ht->count) == 0);
+    int *value = db_lookup(ht, "key", &size);
+    assert(value && *value == 1);
+    free(value);
+    assert(db_version(ht, "key") != 0);
+
+    // A deadline-bound write supersedes the buffered one instead of flushing it
+    db_insert(ht, "key", &one, sizeof(one));
+    struct timespec deadline = deadline_after(100);
+    assert(db_try_insert(ht, "key", &two, sizeof(two), &deadline) == 0);
+    db_flush(ht);
+    value = db_lookup(ht, "key", &size);
+    assert(value && *value == 2);
+    free(value);
+    db_insert(ht, "text", "a", 1);
+    assert(db_try_append(ht, "text", "b", 1, &deadline) == 0);
+    db_flush(ht);
+    char *text = db_lookup(ht, "text", &size);
+    assert(text && size == 2 && memcmp(text, "ab", 2) == 0);
+    free(text);
+    db_insert(ht, "gone", &one, sizeof(one));
+    assert(db_try_delete(ht, "gone", &deadline) == 0);
+    db_flush(ht);
+    assert(!db_lookup(ht, "gone", &size));
+
+    // Clearing drops the thread's buffered writes too
+    db_insert(ht, "cleared", &one, sizeof(one));
+    db_clear(ht);
+    assert(!db_lookup(ht, "cleared", &size));
+    db_flush(ht);
+    assert(atomic_load(&ht->count) == 0);
+
+    db_insert(ht, "closed", &one, sizeof(one));
+    db_serialize(ht, "test_write_behind.bin");
+    db_close(ht);
+    ht = db_open(INITIAL_TABLE_SIZE);
+    db_deserialize(ht, "test_write_behind.bin");
+    assert(db_contains(ht, "closed"));
+    db_close(ht);
+    remove("test_write_behind.bin");
+}
+
+// A warm start serves every key as if the snapshot were loaded, loading cold segments on demand
+void test_warm_start(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    char key[32];
+    for (int i = 0; i < 50000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    assert(db_serialize_segmented(ht, "test_warm.bin") == 0);
+    assert(db_serialize(ht, "test_plain.bin") == 0);
+    db_close(ht);
+
+    ht = db_open(INITIAL_TABLE_SIZE);
+    assert(db_warm_start(ht, "test_plain.bin") == -1);
+    assert(db_warm_start(ht, "test_warm.bin") == 0);
+    size_t size;
+    int *value = db_lookup(ht, "key49999", &size);
+    assert(value && *value == 49999);
+    free(value);
+    int changed = -1;
+    db_insert(ht, "key7", &changed, sizeof(changed)); // Not overwritten when its segment loads
+    assert(db_delete(ht, "key8") == 0);
+    for (int i = 0; i < 50000; i += 97) {
+        snprintf(key, sizeof(key), "key%d", i);
+        struct timespec deadline = deadline_after(1);
+        void *found;
+        int rc = db_try_lookup(ht, key, &found, &size, &deadline);
+        assert(rc == 0 || rc == DB_BUSY); // A deadline-bound call never loads a segment itself
+        if (rc == 0) {
+            assert(*(int *)found == i);
+            free(found);
+        }
+    }
+    db_warm_finish(ht);
+    assert(atomic_load(&ht->count) == 49999);
+    value = db_lookup(ht, "key7", &size);
+    assert(value && *value == -1);
+    free(value);
+    assert(!db_contains(ht, "key8"));
+    db_close(ht);
+
+    ht = db_open(INITIAL_TABLE_SIZE);
+    assert(db_warm_start(ht, "test_warm.bin") == 0);
+    db_close(ht); // Closing stops the loader early
+    remove("test_warm.bin");
+    remove("test_plain.bin");
+}
+
+// Read the key of the db_serialize record at the current file position
+void read_record_key(FILE *file, char *key, size_t capacity) {
+    size_t key_length, value_size;
+    assert(fread(&key_length, sizeof(size_t), 1, file) == 1 && key_length <= capacity);
+    assert(fread(key, 1, key_length, file) == key_length);
+    assert(fread(&value_size, sizeof(size_t), 1, file) == 1);
+    fseek(file, (long)value_size, SEEK_CUR);
+}
+
+// Hot snapshots write the most looked-up keys first, whole files and segmented ones alike
+void test_hot_snapshots(void) {
+    Hashtable *ht = db_open(INITIAL_TABLE_SIZE);
+    char key[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    size_t size;
+    for (int i = 0; i < 100; i++) {
+        free(db_lookup(ht, "key4321", &size));
+        if (i < 50) free(db_lookup(ht, "key17", &size));
+    }
+    assert(db_serialize_hot(ht, "test_hot.bin") == 0);
+    assert(db_serialize_segmented(ht, "test_hot_segments.bin") == 0);
+    db_close(ht);
+
+    FILE *file = fopen("test_hot.bin", "rb");
+    read_record_key(file, key, sizeof(key));
+    assert(strcmp(key, "key4321") == 0);
+    read_record_key(file, key, sizeof(key));
+    assert(strcmp(key, "key17") == 0);
+    fclose(file);
+
+    // The segment written first holds the hottest key, first
+    file = fopen("test_hot_segments.bin", "rb");
+    char magic[8];
+    uint64_t header[2];
+    assert(fread(magic, 1, 8, file) == 8 && fread(header, sizeof(uint64_t), 2, file) == 2 && header[1] == 5000);
+    fseek(file, (long)(8 + sizeof(header) + 2 * sizeof(uint64_t) * header[0]), SEEK_SET);
+    read_record_key(file, key, sizeof(key));
+    assert(strcmp(key, "key4321") == 0);
+    fclose(file);
+
+    ht = db_open(INITIAL_TABLE_SIZE);
+    assert(db_deserialize(ht, "test_hot.bin") == 0 && atomic_load(&ht->count) == 5000);
+    db_close(ht);
+    remove("test_hot.bin");
+    remove("test_hot_segments.bin");
+}
+
+void *prefault_writer(void *arg) {
+    Hashtable *ht = arg;
+    char key[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i % 5000);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    return NULL;
+}
+
+// Prefaulting keeps the contents and runs alongside writers, page turns of a log included
+void test_prefault(void) {
+    Hashtable *ht = db_open(1 << 16);
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        db_insert(ht, key, &i, sizeof(i));
+    }
+    db_prefault(ht, 2);
+    size_t size;
+    int *value = db_lookup(ht, "key999", &size);
+    assert(value && *value == 999);
+    free(value);
+    assert(db_serialize(ht, "test_prefault.bin") == 0);
+    db_close(ht);
+
+    ht = db_open_flags(INITIAL_TABLE_SIZE, DB_PREFAULT); // Prefaults once the snapshot has sized the table
+    assert(db_deserialize(ht, "test_prefault.bin") == 0 && atomic_load(&ht->count) == 1000);
+    db_close(ht);
+    remove("test_prefault.bin");
+
+    ht = db_open_log(1 << 12, "test_prefault.log", 1 << 20);
+    pthread_t writer;
+    pthread_create(&writer, NULL, prefault_writer, ht);
+    for (int i = 0; i < 20; i++) {
+        db_prefault(ht, 2);
+    }
+    pthread_join(writer, NULL);
+    value = db_lookup(ht, "key4999", &size);
+    assert(value && *value == 19999);
+    free(value);
+    db_close(ht);
+    remove("test_prefault.log");
+}
+
+int main() {
+    test_frozen();
+    test_left_right();
+    test_rcu();
+    test_parallel_rehash();
+    test_trees();
+    test_reseed();
+    test_move_to_front();
+    test_entry_size();
+    test_tagged_buckets();
+    test_insertion_order();
+    test_sparse();
+    test_sets();
+    test_append();
+    test_ranges();
+    test_scatter_gather();
+    test_namespaces();
+    test_clear();
+    test_wait();
+    test_deadlines();
+    test_log();
+    test_write_behind();
+    test_warm_start();
+    test_hot_snapshots();
+    test_prefault();
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,37 @@
+#include "static_hashtable.hpp"
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+using hashtable::make_static_hashtable;
+
+// Compile-time tables find every key and reject keys they do not hold
+constexpr auto greek = make_static_hashtable<int>({{"alpha", 1}, {"beta", 2}, {"gamma", 3}, {"delta", 4}, {"epsilon", 5},
+                                                   {"zeta", 6}, {"eta", 7}, {"theta", 8}, {"iota", 9}, {"kappa", 10}});
+static_assert(*greek.lookup("alpha") == 1 && *greek.lookup("kappa") == 10);
+static_assert(greek.lookup("omega") == nullptr && greek.size() == 10);
+
+constexpr auto single = make_static_hashtable<const char *>({{"only", "one"}});
+static_assert(single.contains("only") && !single.contains("other") && !single.contains(""));
+
+int main() {
+    // Misses that land on every position past the last slot
+    for (int i = 0; i < 1000; i++) {
+        assert(!greek.contains("missing" + std::to_string(i)));
+        assert(!single.contains("missing" + std::to_string(i)));
+    }
+    assert(*greek.lookup(std::string("theta")) == 8);
+
+    // Duplicate keys are rejected up front instead of searching for pilots
+    bool rejected = false;
+    try {
+        auto duplicate = make_static_hashtable<int>({{"same", 1}, {"same", 2}});
+        (void)duplicate;
+    } catch (const std::logic_error &) {
+        rejected = true;
+    }
+    assert(rejected);
+    printf("All static table tests passed\n");
+    return 0;
+}